@@ -0,0 +1,391 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "xping.h"
+
+extern char **environ;
+
+/*
+ * State of every target, up, degraded or down, by its results as they
+ * are marked. A target is down after a number of probes lost in a row
+ * and up again after a number of replies in a row, so a single reply
+ * or loss doesn't flap it. It is degraded while its recent loss, an
+ * average decaying by 1/16 per probe, is at a threshold, and up again
+ * once below half of it. Each result is a few comparisons, nothing is
+ * looked at again.
+ *
+ * Changes of state are events, written with -J and given to a hook
+ * (-e): a FIFO or UNIX socket gets a line per event, anything else is
+ * a command run per event. At most WORKERS commands run at a time,
+ * events wait in a queue of QUEUE_MAX and are dropped beyond it. Lines
+ * not taken by the reader are dropped beyond BACKLOG_MAX, and a reader
+ * gone is reconnected at the next event.
+ */
+#define WORKERS		4
+#define QUEUE_MAX	1024
+#define BACKLOG_MAX	(64 * 1024)
+#define LOSS_ONE	65536		/* recent loss of all probes */
+
+#define HOOK_NONE	0
+#define HOOK_COMMAND	1
+#define HOOK_FIFO	2
+#define HOOK_SOCKET	3
+
+static const char *names[] = { "unknown", "up", "degraded", "down" };
+
+static int down_after = 2;	/* probes lost in a row */
+static int up_after = 2;	/* replies in a row */
+static unsigned int degraded_at;	/* recent loss, 0 for never */
+
+static int enabled;		/* -d or -e given, events told */
+static const char *hook;
+static int hook_type = HOOK_NONE;
+static struct bufferevent *bev;	/* to a FIFO or socket */
+
+struct job {
+	char		target[16 + MAXHOST];
+	char		state[32];
+	char		from[32];
+	char		time[48];
+	char		seq[32];
+	struct job	*next;
+};
+static struct job *queue, *queue_tail;
+static int queued;
+static pid_t workers[WORKERS];	/* commands running, 0 for none */
+static int running;
+static struct event *ev_child;
+
+static unsigned long events;
+static unsigned long hooks_run;
+static unsigned long dropped;
+
+/*
+ * Thresholds as "down,up,loss", each optional, loss in percent.
+ */
+int
+alert_init(const char *spec, const char *path)
+{
+	struct stat sb;
+	char *end;
+	long v;
+
+	if (spec != NULL || path != NULL)
+		enabled = 1;
+	if (spec != NULL) {
+		v = strtol(spec, &end, 10);
+		if (end != spec)
+			down_after = v;
+		if (*end == ',') {
+			spec = end + 1;
+			v = strtol(spec, &end, 10);
+			if (end != spec)
+				up_after = v;
+		}
+		if (*end == ',') {
+			spec = end + 1;
+			v = strtol(spec, &end, 10);
+			if (end == spec || v < 0 || v > 100)
+				return -1;
+			degraded_at = v * LOSS_ONE / 100;
+		}
+		if (*end != '\0' || down_after < 1 || up_after < 1)
+			return -1;
+	}
+	if (path == NULL)
+		return 0;
+	hook = path;
+	if (stat(path, &sb) == 0 && S_ISFIFO(sb.st_mode))
+		hook_type = HOOK_FIFO;
+	else if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		hook_type = HOOK_SOCKET;
+	else
+		hook_type = HOOK_COMMAND;
+	if (hook_type != HOOK_COMMAND)
+		signal(SIGPIPE, SIG_IGN);	/* reader gone, EPIPE */
+	return 0;
+}
+
+static void
+closed(struct bufferevent *b, short what, void *thunk)
+{
+
+	if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+		bufferevent_free(bev);
+		bev = NULL;
+	}
+}
+
+/*
+ * Open the FIFO or connect to the socket, unless done. A FIFO without
+ * a reader can't be opened, it is tried again at the next event.
+ */
+static int
+hook_open(void)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (bev != NULL)
+		return 0;
+	if (hook_type == HOOK_FIFO) {
+		fd = open(hook, O_WRONLY | O_NONBLOCK);
+		if (fd < 0)
+			return -1;
+	} else {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(hook) >= sizeof(sun.sun_path))
+			return -1;
+		strcpy(sun.sun_path, hook);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+			close(fd);
+			return -1;
+		}
+		evutil_make_socket_nonblocking(fd);
+	}
+	bev = bufferevent_socket_new(ev_base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (bev == NULL) {
+		close(fd);
+		return -1;
+	}
+	bufferevent_setcb(bev, NULL, NULL, closed, NULL);
+	bufferevent_enable(bev, EV_WRITE);
+	return 0;
+}
+
+/*
+ * Run queued commands while workers are free, with the event in the
+ * environment. The environment is put together before the fork.
+ */
+static void
+run(void)
+{
+	struct job *job;
+	char **envp;
+	char *argv[4];
+	int i, n;
+	pid_t pid;
+
+	while (running < WORKERS && queue != NULL) {
+		job = queue;
+		queue = job->next;
+		if (queue == NULL)
+			queue_tail = NULL;
+		queued--;
+		for (n = 0; environ[n] != NULL; n++)
+			;
+		envp = calloc(n + 6, sizeof(*envp));
+		if (envp == NULL) {
+			free(job);
+			dropped++;
+			continue;
+		}
+		memcpy(envp, environ, n * sizeof(*envp));
+		envp[n++] = job->target;
+		envp[n++] = job->state;
+		envp[n++] = job->from;
+		envp[n++] = job->time;
+		envp[n++] = job->seq;
+		argv[0] = "sh";
+		argv[1] = "-c";
+		argv[2] = (char *)hook;
+		argv[3] = NULL;
+		pid = fork();
+		if (pid == 0) {
+			execve("/bin/sh", argv, envp);
+			_exit(127);
+		}
+		free(envp);
+		free(job);
+		if (pid < 0) {
+			dropped++;
+			continue;
+		}
+		for (i = 0; workers[i] != 0; i++)
+			;
+		workers[i] = pid;
+		running++;
+		hooks_run++;
+	}
+}
+
+/*
+ * A child exited, free the worker of a command. Other children, e.g.
+ * of ping(8) with xping-unpriv, are reaped as well.
+ */
+static void
+reap(int sig, short what, void *thunk)
+{
+	pid_t pid;
+	int i;
+
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		for (i = 0; i < WORKERS; i++) {
+			if (workers[i] == pid) {
+				workers[i] = 0;
+				running--;
+			}
+		}
+	}
+	run();
+}
+
+/*
+ * Tell of a change of state, on the report and to the hook.
+ */
+static void
+emit(struct target *t, int seq, int from, int to)
+{
+	struct timeval now;
+	struct evbuffer *out;
+	struct job *job;
+
+	events++;
+	report_event(t, seq, names[to], names[from]);
+	if (hook_type == HOOK_NONE)
+		return;
+	evutil_gettimeofday(&now, NULL);
+	if (hook_type != HOOK_COMMAND) {
+		if (hook_open() < 0) {
+			dropped++;
+			return;
+		}
+		out = bufferevent_get_output(bev);
+		if (evbuffer_get_length(out) >= BACKLOG_MAX) {
+			dropped++;
+			return;
+		}
+		evbuffer_add_printf(out, "%ld.%06ld %s %s %s %d\n",
+		    (long)now.tv_sec, (long)now.tv_usec, t->host, names[to],
+		    names[from], seq);
+		return;
+	}
+	if (queued >= QUEUE_MAX || (job = malloc(sizeof(*job))) == NULL) {
+		dropped++;
+		return;
+	}
+	snprintf(job->target, sizeof(job->target), "XPING_TARGET=%s",
+	    t->host);
+	snprintf(job->state, sizeof(job->state), "XPING_STATE=%s",
+	    names[to]);
+	snprintf(job->from, sizeof(job->from), "XPING_FROM=%s", names[from]);
+	snprintf(job->time, sizeof(job->time), "XPING_TIME=%ld.%06ld",
+	    (long)now.tv_sec, (long)now.tv_usec);
+	snprintf(job->seq, sizeof(job->seq), "XPING_SEQ=%d", seq);
+	job->next = NULL;
+	if (queue_tail != NULL)
+		queue_tail->next = job;
+	else
+		queue = job;
+	queue_tail = job;
+	queued++;
+	if (ev_child == NULL) {
+		ev_child = evsignal_new(ev_base, SIGCHLD, reap, NULL);
+		event_add(ev_child, NULL);
+	}
+	run();
+}
+
+/*
+ * A result was marked for a probe, over the one it had. The target
+ * moves along by the first result of each probe, returns its state.
+ */
+int
+alert_result(struct target *t, int seq, int old)
+{
+	struct alert *a = &t->alert;
+	int state;
+
+	if (old != ' ' || t->res[seq % NUM] == ' ')
+		return a->state;
+	if (t->res[seq % NUM] != '.') {
+		a->lostrun++;
+		a->okrun = 0;
+		a->loss += (LOSS_ONE - a->loss) / 16;
+	} else {
+		a->okrun++;
+		a->lostrun = 0;
+		a->loss -= a->loss / 16;
+	}
+
+	state = a->state;
+	if (a->lostrun >= down_after)
+		state = ALERT_DOWN;
+	else if (state == ALERT_DOWN && a->okrun < up_after)
+		; /* down until enough replies in a row */
+	else if (degraded_at > 0 && a->loss >= degraded_at)
+		state = ALERT_DEGRADED;
+	else if (state == ALERT_DEGRADED && a->loss >= degraded_at / 2)
+		; /* degraded until loss is well below */
+	else if (a->okrun > 0)
+		state = ALERT_UP;
+	if (state != a->state) {
+		if (enabled)
+			emit(t, seq, a->state, state);
+		a->state = state;
+	}
+	return state;
+}
+
+void
+alert_stats(stats_cb_type cb, void *thunk)
+{
+
+	cb("alert_events", events, thunk);
+	if (hook_type == HOOK_NONE)
+		return;
+	cb("alert_hooks_run", hooks_run, thunk);
+	cb("alert_hooks_running", running, thunk);
+	cb("alert_queued", queued, thunk);
+	cb("alert_dropped", dropped, thunk);
+}
+
+void
+alert_cleanup(void)
+{
+	struct job *job;
+
+	while ((job = queue) != NULL) {
+		queue = job->next;
+		free(job);
+	}
+	queue_tail = NULL;
+	if (bev != NULL) {
+		/* what the reader takes without waiting */
+		evbuffer_write(bufferevent_get_output(bev),
+		    bufferevent_getfd(bev));
+		bufferevent_free(bev);
+	}
+	bev = NULL;
+	if (ev_child != NULL)
+		event_free(ev_child);
+	ev_child = NULL;
+}
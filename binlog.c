@@ -0,0 +1,407 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/util.h>
+
+#include "xping.h"
+
+/*
+ * Binary log of results (-L), read back by xping-replay. The file is a
+ * header followed by blocks of BINLOG_BLOCK bytes, appended as they
+ * fill. A block starts with its header, giving the time of its first
+ * record, and holds whole records:
+ *
+ *	type, time since previous record (microseconds)
+ *	BINLOG_RESULT	target, seq, symbol, round trip time + 1 or 0
+ *	BINLOG_TARGET	target, length, name
+ *	BINLOG_REMOVE	target
+ *
+ * Numbers are unsigned LEB128 varints, the symbol a byte, and targets
+ * are numbered from 1 as first logged. Now and then a block flagged as
+ * checkpoint starts with the names of all targets, so reading can
+ * start there without the blocks before it. Names of many targets take
+ * several blocks, and checkpoints are BINLOG_CHECKPOINT blocks apart
+ * for every block they take, so names never take much of the log. As
+ * blocks are of fixed size and their times increase, the block of a
+ * time is found by binary search.
+ */
+static int fd = -1;
+static unsigned char block[BINLOG_BLOCK];
+static size_t used;		/* of block, 0 when not started */
+static uint64_t last;		/* time of last record */
+static unsigned long nblocks;
+static unsigned long records;
+static unsigned long errors;
+static unsigned int ntargets;
+static int checkpointing;
+static unsigned long cpstart;	/* block of the last checkpoint */
+static unsigned long cplen = 1;	/* blocks it took */
+
+static uint64_t
+now(void)
+{
+	struct timeval tv;
+
+	evutil_gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+static size_t
+putvarint(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/*
+ * Decode a varint within end, returns the bytes used or 0 if invalid.
+ */
+static size_t
+getvarint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+	size_t n = 0;
+	int shift = 0;
+
+	*v = 0;
+	while (p + n < end && shift < 64) {
+		*v |= (uint64_t)(p[n] & 0x7f) << shift;
+		if ((p[n++] & 0x80) == 0)
+			return n;
+		shift += 7;
+	}
+	return 0;
+}
+
+/*
+ * Write out the block, the rest of it zero. Logging stops at an error,
+ * as a block partly written would leave the blocks after it misplaced.
+ */
+static void
+finish(void)
+{
+	ssize_t n;
+	size_t off = 0;
+
+	if (used == 0 || fd < 0) {
+		used = 0;
+		return;
+	}
+	block[6] = used & 0xff;
+	block[7] = used >> 8;
+	memset(block + used, 0, sizeof(block) - used);
+	while (off < sizeof(block)) {
+		n = write(fd, block + off, sizeof(block) - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			errors++;
+			close(fd);
+			fd = -1;
+			used = 0;
+			return;
+		}
+		off += n;
+	}
+	nblocks++;
+	used = 0;
+}
+
+static void put(int, const unsigned char *, size_t, uint64_t);
+
+static void
+putname(struct target *t, uint64_t time)
+{
+	unsigned char body[2 * 10 + sizeof(t->host)];
+	size_t n, len = strnlen(t->host, sizeof(t->host));
+
+	n = putvarint(body, t->logidx);
+	n += putvarint(body + n, len);
+	memcpy(body + n, t->host, len);
+	put(BINLOG_TARGET, body, n + len, time);
+}
+
+/*
+ * Start a block, as a checkpoint naming all targets now and then.
+ */
+static void
+begin(uint64_t time)
+{
+	struct target *t;
+
+	memcpy(block, BINLOG_BLOCK_MAGIC, 4);
+	block[4] = block[5] = 0;
+	put64(block + 8, time);
+	used = BINLOG_BLOCK_HDR;
+	last = time;
+	if (checkpointing ||
+	    (nblocks > 0 && nblocks - cpstart < BINLOG_CHECKPOINT * cplen))
+		return;
+	block[4] = BINLOG_F_CHECKPOINT;
+	cpstart = nblocks;
+	checkpointing = 1;
+	DL_FOREACH(list, t)
+		if (t->logidx != 0)
+			putname(t, time);
+	checkpointing = 0;
+	cplen = nblocks - cpstart + 1;
+}
+
+/*
+ * Add a record, in a new block if it doesn't fit.
+ */
+static void
+put(int type, const unsigned char *body, size_t len, uint64_t time)
+{
+
+	if (used != 0 && used + 1 + 10 + len > sizeof(block))
+		finish();
+	if (used == 0)
+		begin(time);
+	if (used + 1 + 10 + len > sizeof(block)) {
+		/* names of a checkpoint filled the block */
+		finish();
+		begin(time);
+	}
+	block[used++] = type;
+	used += putvarint(block + used, time > last ? time - last : 0);
+	memcpy(block + used, body, len);
+	used += len;
+	last = MAX(time, last);
+	records++;
+}
+
+int
+binlog_open(const char *path)
+{
+	unsigned char hdr[BINLOG_HDR];
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, BINLOG_MAGIC, 8);
+	hdr[8] = BINLOG_VERSION;
+	put64(hdr + 16, BINLOG_BLOCK);
+	if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * A target was added or renamed.
+ */
+void
+binlog_target(struct target *t)
+{
+
+	if (fd < 0)
+		return;
+	if (t->logidx == 0)
+		t->logidx = ++ntargets;
+	putname(t, now());
+}
+
+void
+binlog_remove(struct target *t)
+{
+	unsigned char body[10];
+
+	if (fd < 0 || t->logidx == 0)
+		return;
+	put(BINLOG_REMOVE, body, putvarint(body, t->logidx), now());
+	t->logidx = 0;
+}
+
+/*
+ * A result was marked, with the round trip time in microseconds or -1
+ * when not timed.
+ */
+void
+binlog_result(struct target *t, int seq, long rtt)
+{
+	unsigned char body[3 * 10 + 1];
+	size_t n;
+
+	if (fd < 0 || t->logidx == 0)
+		return;
+	n = putvarint(body, t->logidx);
+	n += putvarint(body + n, seq);
+	body[n++] = t->res[seq % NUM];
+	n += putvarint(body + n, rtt + 1);
+	put(BINLOG_RESULT, body, n, now());
+}
+
+void
+binlog_stats(stats_cb_type cb, void *thunk)
+{
+
+	if (fd < 0 && errors == 0)
+		return;
+	cb("binlog_records", records, thunk);
+	cb("binlog_blocks", nblocks, thunk);
+	cb("binlog_errors", errors, thunk);
+}
+
+void
+binlog_close(void)
+{
+
+	if (fd < 0)
+		return;
+	finish();
+	close(fd);
+	fd = -1;
+}
+
+/*
+ * Reading, of a log mapped in memory.
+ */
+int
+binlog_reader(struct binlog_reader *r, const void *map, size_t size)
+{
+
+	memset(r, 0, sizeof(*r));
+	if (size < BINLOG_HDR || memcmp(map, BINLOG_MAGIC, 8) != 0 ||
+	    ((const unsigned char *)map)[8] != BINLOG_VERSION ||
+	    get64((const unsigned char *)map + 16) != BINLOG_BLOCK)
+		return -1;
+	r->map = map;
+	r->nblocks = (size - BINLOG_HDR) / BINLOG_BLOCK;
+	return 0;
+}
+
+static const unsigned char *
+blockat(struct binlog_reader *r, size_t i)
+{
+
+	return r->map + BINLOG_HDR + i * BINLOG_BLOCK;
+}
+
+/*
+ * Position at the last checkpoint before a time, or the first block.
+ */
+void
+binlog_seek(struct binlog_reader *r, uint64_t time)
+{
+	size_t lo = 0, hi = r->nblocks, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (get64(blockat(r, mid) + 8) <= time)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	while (lo > 0 && !(blockat(r, lo)[4] & BINLOG_F_CHECKPOINT))
+		lo--;
+	r->block = lo;
+	r->off = 0;
+}
+
+/*
+ * Read the next record. Returns 1 for a record, 0 at the end and -1 if
+ * the log is invalid.
+ */
+int
+binlog_read(struct binlog_reader *r, struct binlog_record *rec)
+{
+	const unsigned char *b, *p, *end;
+	uint64_t v[4];
+	size_t n;
+	int i, nv;
+
+	for (;;) {
+		if (r->block >= r->nblocks)
+			return 0;
+		b = blockat(r, r->block);
+		if (memcmp(b, BINLOG_BLOCK_MAGIC, 4) != 0)
+			return -1;
+		if (r->off == 0) {
+			r->off = BINLOG_BLOCK_HDR;
+			r->time = get64(b + 8);
+		}
+		end = b + MIN(b[6] | b[7] << 8, BINLOG_BLOCK);
+		if (b + r->off < end)
+			break;
+		r->block++;
+		r->off = 0;
+	}
+	p = b + r->off;
+	rec->type = *p++;
+	nv = (rec->type == BINLOG_REMOVE ? 2 : 3);
+	for (i = 0; i < nv; i++) {
+		if ((n = getvarint(p, end, &v[i])) == 0)
+			return -1;
+		p += n;
+	}
+	r->time += v[0];
+	rec->time = r->time;
+	rec->idx = v[1];
+	switch (rec->type) {
+	case BINLOG_RESULT:
+		rec->seq = v[2];
+		if (p >= end)
+			return -1;
+		rec->symbol = *p++;
+		if ((n = getvarint(p, end, &v[3])) == 0)
+			return -1;
+		p += n;
+		rec->rtt = (long)v[3] - 1;
+		break;
+	case BINLOG_TARGET:
+		if (v[2] > (uint64_t)(end - p))
+			return -1;
+		rec->name = (const char *)p;
+		rec->namelen = v[2];
+		p += v[2];
+		break;
+	case BINLOG_REMOVE:
+		break;
+	default:
+		return -1;
+	}
+	r->off = p - b;
+	return 1;
+}
@@ -0,0 +1,197 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/util.h>
+
+#include "xping.h"
+#include "xpingboard.h"
+
+/*
+ * Status board (-S), state of every target published in a shared
+ * mapping as laid out in xpingboard.h. The board is sized when opened,
+ * with room for the addresses of expanded hostnames as asked for.
+ * Targets beyond it are left out and counted. Records of removed
+ * targets are kept on a free list for targets added later.
+ */
+static struct xpb_header *board;
+static size_t size;
+static int *freelist;		/* records not in use */
+static int nfree;
+static unsigned long writes;
+static unsigned long full;
+
+static struct xpb_target *
+record(int i)
+{
+
+	return (struct xpb_target *)((char *)board + sizeof(*board)) + i;
+}
+
+/*
+ * Write a record under its sequence lock.
+ */
+static void
+begin(struct xpb_target *rec)
+{
+
+	__atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+end(struct xpb_target *rec)
+{
+
+	__atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELEASE);
+	writes++;
+}
+
+int
+board_open(const char *path, int capacity)
+{
+	struct timeval tv;
+	int fd, i;
+
+	capacity = MAX(capacity, 1);
+	size = sizeof(*board) + (size_t)capacity * sizeof(struct xpb_target);
+	freelist = calloc(capacity, sizeof(*freelist));
+	if (freelist == NULL)
+		return -1;
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	board = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (board == MAP_FAILED) {
+		board = NULL;
+		return -1;
+	}
+	evutil_gettimeofday(&tv, NULL);
+	board->version = XPB_VERSION;
+	board->hdrsize = sizeof(*board);
+	board->recsize = sizeof(struct xpb_target);
+	board->window = XPB_WINDOW;
+	board->capacity = capacity;
+	board->pid = getpid();
+	board->interval = i_interval;
+	board->started = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	for (i = capacity - 1; i >= 0; i--)
+		freelist[nfree++] = i;
+	/* readers know the board is ready by its magic */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(board->magic, XPB_MAGIC, sizeof(board->magic));
+	return 0;
+}
+
+/*
+ * Give a target a record.
+ */
+void
+board_add(struct target *t)
+{
+	struct xpb_target *rec;
+	int i;
+
+	if (board == NULL || t->boardidx > 0)
+		return;
+	if (nfree == 0) {
+		full++;
+		return;
+	}
+	i = freelist[--nfree];
+	t->boardidx = i + 1;
+	rec = record(i);
+	begin(rec);
+	rec->flags = XPB_USED;
+	rec->rtt = -1;
+	memset(rec->res, ' ', sizeof(rec->res));
+	end(rec);
+	if ((uint32_t)i >= board->used)
+		__atomic_store_n(&board->used, i + 1, __ATOMIC_RELEASE);
+	board_update(t, -1, -1);
+}
+
+void
+board_remove(struct target *t)
+{
+	struct xpb_target *rec;
+
+	if (board == NULL || t->boardidx == 0)
+		return;
+	rec = record(t->boardidx - 1);
+	begin(rec);
+	rec->flags = 0;
+	end(rec);
+	freelist[nfree++] = t->boardidx - 1;
+	t->boardidx = 0;
+}
+
+/*
+ * Publish the state of a target, the result of a probe when given and
+ * a round trip time when timed.
+ */
+void
+board_update(struct target *t, int seq, long rtt)
+{
+	struct xpb_target *rec;
+
+	if (board == NULL || t->boardidx == 0)
+		return;
+	rec = record(t->boardidx - 1);
+	begin(rec);
+	memcpy(rec->host, t->host, sizeof(rec->host));
+	rec->af = t->af;
+	rec->npkts = t->npkts;
+	rec->first = t->first;
+	if (rtt >= 0)
+		rec->rtt = rtt;
+	rec->srtt = t->srtt;
+	rec->received = t->received;
+	rec->late = t->late;
+	rec->unreachable = t->unreachable;
+	rec->errors = t->errors;
+	if (seq >= 0)
+		rec->res[seq % XPB_WINDOW] = t->res[seq % NUM];
+	end(rec);
+}
+
+void
+board_stats(stats_cb_type cb, void *thunk)
+{
+
+	if (board == NULL)
+		return;
+	cb("board_writes", writes, thunk);
+	cb("board_free", nfree, thunk);
+	cb("board_full", full, thunk);
+}
+
+void
+board_close(void)
+{
+
+	if (board == NULL)
+		return;
+	__atomic_store_n(&board->pid, 0, __ATOMIC_RELEASE);
+	munmap(board, size);
+	board = NULL;
+	free(freelist);
+	freelist = NULL;
+}
@@ -8,11 +8,19 @@
  */
 
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <event2/event.h>
 #include <event2/dns.h>
@@ -20,136 +28,1227 @@
 #include "xping.h"
 
 #define MAXHOST 64
+#define RETRY 60 /* seconds */
 
 extern int v4_flag;
 extern int v6_flag;
+extern int p_family;
 extern int T_flag;
+extern int Q_rate;
+extern int j_inflight;
 extern struct event_base *ev_base;
 extern struct evdns_base *dns;
 
+static const struct timeval *tv_retry;
+
+/*
+ * Resolving is shared between all targets of the same hostname. A
+ * dnsentry holds the queries and the latest result for a hostname,
+ * each dnstask subscribes a probe to an entry and gets every result
+ * fanned out. Entries are kept in a hash on hostname, and are
+ * reference counted by their subscribers.
+ */
+struct dnsentry {
+	char		host[MAXHOST];
+	int		refcnt;
+	int		pending;
+	int		found;
+	int		published;
+	int		ttl;
+	int		answered;
+	struct dnsset	set;
+	time_t		expires;
+	struct evdns_request *req6;
+	struct evdns_request *req4;
+	int		queued;
+	struct dnsentry	*qprev, *qnext;
+	struct timeval	due;
+	int		wheeled;
+	int		refreshing;
+	uint64_t	tick;
+	struct dnsentry	*wprev, *wnext;
+	struct timeval	stale;
+	struct event	*ev_resolve;
+	struct event	*ev_replay;
+	struct dnstask	*tasks;
+	UT_hash_handle	hh;
+};
+
+/*
+ * A subscription, reporting either a single address (flags 0), each
+ * family on its own (DNSTASK_DUAL) or all addresses (DNSTASK_SET). The
+ * time from subscribing, or from a refresh being due, until the first
+ * usable result is kept as the resolution latency of the target. Time
+ * waiting for admission is included.
+ */
+#define DNSTASK_SET	0x02
+#define DNSTASK_NAME	0x04
+
 struct dnstask {
+	int		flags;
 	dnstask_cb_type	cb;
+	dnstask_set_cb_type set_cb;
+	dnstask_name_cb_type name_cb;
 	void		*thunk;
+	struct dnsentry	*entry;
+	struct dnsname	*name;
+	int		replay;
+	int		timed;
+	struct timeval	since;
+	long		latency;
+	struct dnstask	*prev, *next;
+};
+
+static struct dnsentry *entries;
+static unsigned long subscribers;
+static unsigned long queries;
+static unsigned long resolutions;
+static unsigned long latency_sum;
+static unsigned long latency_max;
+
+/*
+ * Admission of queries to the resolver. Entries due for resolving wait
+ * in a queue, unresolved ones ahead of refreshes, until both the
+ * queries per second budget (-Q, a token bucket) and the limit of
+ * queries in flight (-j) allow them to be sent.
+ */
+#define QUEUE_UNRESOLVED 0
+#define QUEUE_REFRESH 1
+static struct dnsentry *queue[2];
+static unsigned long depth[2];
+static unsigned long depth_max;
+static unsigned long throttled;
+static int inflight;
+static double tokens;
+static struct timeval tv_tokens;
+static struct event *ev_admit;
+static void admit(int, short, void *);
+struct dnsname;
+static void sendname(struct dnsname *);
+
+/*
+ * Reverse lookups of addresses (-N), for labeling targets. They are
+ * admitted only when no hostname is waiting, and may take at most half
+ * of the queries in flight, so they never hold back resolving. Names
+ * no longer subscribed to are kept in a bounded LRU, failed lookups
+ * included, so they are not asked again.
+ */
+#define NAME_QUEUED 0
+#define NAME_INFLIGHT 1
+#define NAME_DONE 2
+#define NAME_CACHE 4096
+
+struct dnsname {
+	char		key[INET6_ADDRSTRLEN];
+	int		af;
+	struct in6_addr	addr6;
+	struct in_addr	addr4;
+	int		state;
+	char		name[MAXHOST];
+	int		refcnt;
+	struct evdns_request *req;
+	struct event	*ev_replay;
+	struct dnstask	*tasks;
+	struct dnsname	*prev, *next;	/* name queue or LRU */
+	UT_hash_handle	hh;
+};
+
+static struct dnsname *names;
+static struct dnsname *names_queue;
+static struct dnsname *names_lru;
+static unsigned long names_queued;
+static unsigned long names_cached;
+static unsigned long names_queries;
+static unsigned long names_hits;
+
+/*
+ * Persistent cache of resolved addresses (-D). The file holds a header
+ * followed by fixed size records sorted on hostname, so a loaded file
+ * is used in place through mmap and searched as entries are set up.
+ */
+#define CACHE_MAGIC 0x78646e73	/* "xdns" */
+#define CACHE_VERSION 2
+
+struct cachehdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	recsize;
+	uint32_t	count;
+};
+
+struct cacherec {
 	char		host[MAXHOST];
-	struct event	*ev_resolve;
+	int64_t		expires;
+	struct dnsset	set;
 };
 
 /*
- * Reschedule a DNS request.
+ * Refreshing with -T. A refresh is due ahead of expiry, by a tenth of
+ * the TTL plus a random share of another tenth, so the new answer is
+ * in before the old one goes stale, and hostnames resolved together
+ * drift apart instead of re-querying in lockstep. Entries waiting for
+ * their refresh are kept on a timing wheel of REFRESH_TICK slots, a
+ * single timer walks it and queues everything due in a tick at once.
+ */
+#define REFRESH_TICK 100	/* milliseconds */
+#define REFRESH_SLOTS 256
+#define REFRESH_RATE_TICKS (1000 / REFRESH_TICK)
+static struct dnsentry *wheel[REFRESH_SLOTS];
+static unsigned long wheel_count;
+static uint64_t wheel_tick;
+static struct event *ev_wheel;
+static unsigned long refreshes;
+static unsigned long refreshed[REFRESH_RATE_TICKS];
+static unsigned long refresh_late;
+static unsigned long refresh_lateness_max;
+
+static void *cache_map;
+static size_t cache_len;
+static struct cacherec *cache_recs;
+static unsigned long cache_count;
+static unsigned long cache_hits;
+static unsigned long cache_stale;
+
+/*
+ * Retry an unresolved hostname. Retries share their duration and are
+ * kept on a common timeout queue.
  */
 static void
-reschedule(struct event *ev_resolve, int seconds)
+retry(struct dnsentry *entry)
 {
-	struct timeval tv;
 
-	evutil_timerclear(&tv);
-	tv.tv_sec = seconds;
-	event_add(ev_resolve, &tv);
+	event_add(entry->ev_resolve, tv_retry);
 }
 
 /*
- * Callback for A-records resolver results. When failed (NXDOMAIN,
- * SERVFAIL, at al), reschedule a new request.
+ * Queue an entry for admission, unless already queued. Addresses past
+ * their TTL, e.g. from the cache, are queued along with unresolved
+ * hostnames.
  */
 static void
-response_ipv4(int result, char type, int count, int ttl, void *addresses,
-    void *thunk)
+enqueue(struct dnsentry *entry)
+{
+	int q;
+
+	if (entry->queued)
+		return;
+	q = ((entry->set.n6 || entry->set.n4) &&
+	    entry->expires > time(NULL)) ? QUEUE_REFRESH : QUEUE_UNRESOLVED;
+	DL_APPEND2(queue[q], entry, qprev, qnext);
+	entry->queued = q + 1;
+	evutil_gettimeofday(&entry->due, NULL);
+	depth[q]++;
+	depth_max = MAX(depth_max, depth[0] + depth[1]);
+}
+
+static void
+dequeue(struct dnsentry *entry)
 {
-	struct dnstask *task = thunk;
+	int q;
 
-	if (result == DNS_ERR_NONE && count > 0) {
-		task->cb(AF_INET, addresses, task->thunk);
-		/* Schedule new request, enforce a lower bound on ttl. */
-		if (T_flag)
-			reschedule(task->ev_resolve, MAX(ttl, 1));
+	if (!entry->queued)
+		return;
+	q = entry->queued - 1;
+	DL_DELETE2(queue[q], entry, qprev, qnext);
+	entry->queued = 0;
+	depth[q]--;
+}
+
+static uint64_t
+ticks(struct timeval *tv)
+{
+
+	return ((uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000) /
+	    REFRESH_TICK;
+}
+
+/*
+ * Put an entry on the refresh wheel, due in the given number of
+ * milliseconds. The wheel timer only runs while entries are waiting.
+ */
+static void
+wheel_add(struct dnsentry *entry, long delay)
+{
+	struct timeval now, tv;
+
+	evutil_gettimeofday(&now, NULL);
+	if (wheel_count == 0) {
+		wheel_tick = ticks(&now);
+		evutil_timerclear(&tv);
+		tv.tv_usec = REFRESH_TICK * 1000;
+		event_add(ev_wheel, &tv);
+	}
+	entry->tick = ticks(&now) + (delay + REFRESH_TICK - 1) / REFRESH_TICK;
+	DL_APPEND2(wheel[entry->tick % REFRESH_SLOTS], entry, wprev, wnext);
+	entry->wheeled = 1;
+	wheel_count++;
+}
+
+static void
+wheel_del(struct dnsentry *entry)
+{
+
+	if (!entry->wheeled)
+		return;
+	DL_DELETE2(wheel[entry->tick % REFRESH_SLOTS], entry, wprev, wnext);
+	entry->wheeled = 0;
+	if (--wheel_count == 0) {
+		event_del(ev_wheel);
+		memset(refreshed, 0, sizeof(refreshed));
+	}
+}
+
+/*
+ * Schedule the refresh of a resolved entry, see above.
+ */
+static void
+refresh(struct dnsentry *entry)
+{
+	long ttl = (long)MIN(entry->ttl, INT_MAX / 1000) * 1000;
+	long lead;
+
+	lead = ttl / 10 + random() % (ttl / 10 + 1);
+	wheel_add(entry, MAX(ttl - lead, 1000));
+}
+
+/*
+ * Add tokens for the time passed since last refill. The bucket holds
+ * a tenth of a second worth of queries, but at least a round of both
+ * families.
+ */
+static void
+refill(void)
+{
+	struct timeval now, tv;
+	double burst;
+
+	evutil_gettimeofday(&now, NULL);
+	burst = MAX(Q_rate / 10.0, 2);
+	if (evutil_timerisset(&tv_tokens)) {
+		evutil_timersub(&now, &tv_tokens, &tv);
+		tokens += (tv.tv_sec + tv.tv_usec / 1e6) * Q_rate;
 	} else {
-		task->cb(0, NULL, task->thunk);
-		/* neg-TTL might be search domain's */
-		reschedule(task->ev_resolve, 60);
+		tokens = burst;
 	}
+	tv_tokens = now;
+	if (tokens > burst)
+		tokens = burst;
 }
 
 /*
- * Callback for AAAA-records resolver results. When failed (NXDOMAIN,
- * SERVFAIL, at al), retry for A-record. Otherwise reschedule a new
- * request. All diagnostics about the failed request are useless, since
- * they might refer to a search domain request, which is done transparently
- * after the real request.
+ * Remember the addresses of a family, none if it didn't resolve. At
+ * most DNSSET_MAX addresses are kept per family.
  */
 static void
-response_ipv6(int result, char type, int count, int ttl, void *addresses,
-    void *thunk)
+store(struct dnsentry *entry, int af, void *addresses, int count)
 {
-	struct dnstask *task = thunk;
 
-	if (result == DNS_ERR_NONE && count > 0) {
-		task->cb(AF_INET6, addresses, task->thunk);
-		/* Schedule new request, enforce a lower bound on ttl. */
-		if (T_flag)
-			reschedule(task->ev_resolve, MAX(ttl, 1));
+	entry->answered = 1;
+	count = MIN(count, DNSSET_MAX);
+	if (af == AF_INET6) {
+		entry->set.n6 = count;
+		if (count > 0)
+			memcpy(entry->set.addr6, addresses,
+			    count * sizeof(struct in6_addr));
+	} else if (af == AF_INET) {
+		entry->set.n4 = count;
+		if (count > 0)
+			memcpy(entry->set.addr4, addresses,
+			    count * sizeof(struct in_addr));
 	} else {
-		if (!v6_flag) {
-			evdns_base_resolve_ipv4(dns, task->host, 0,
-			    response_ipv4, thunk);
+		entry->set.n6 = 0;
+		entry->set.n4 = 0;
+	}
+}
+
+/*
+ * Record resolution latency of a task, once per round of queries.
+ */
+static void
+timed(struct dnstask *task, struct timeval *now)
+{
+	struct timeval tv, *since;
+	long usec;
+
+	if (task->timed)
+		return;
+	task->timed = 1;
+	since = &task->since;
+	if (evutil_timercmp(&task->entry->due, since, >))
+		since = &task->entry->due;
+	evutil_timersub(now, since, &tv);
+	usec = tv.tv_sec * 1000000L + tv.tv_usec;
+	task->latency = MAX(usec, 0);
+	resolutions++;
+	latency_sum += task->latency;
+	latency_max = MAX(latency_max, (unsigned long)task->latency);
+}
+
+/*
+ * Fan out a result to the subscribers of an entry of a given kind,
+ * flags 0 or DNSTASK_DUAL.
+ */
+static void
+publish(struct dnsentry *entry, int kind, int af, void *address)
+{
+	struct dnstask *task, *tmp;
+	struct timeval now;
+
+	evutil_gettimeofday(&now, NULL);
+	DL_FOREACH_SAFE(entry->tasks, task, tmp) {
+		if (task->flags != kind)
+			continue;
+		if (address != NULL || af == 0)
+			timed(task, &now);
+		task->cb(af, address, task->thunk);
+	}
+}
+
+/*
+ * Fan out all addresses to DNSTASK_SET subscribers of an entry.
+ */
+static void
+publish_set(struct dnsentry *entry)
+{
+	struct dnstask *task, *tmp;
+	struct timeval now;
+
+	evutil_gettimeofday(&now, NULL);
+	DL_FOREACH_SAFE(entry->tasks, task, tmp) {
+		if (task->flags != DNSTASK_SET)
+			continue;
+		timed(task, &now);
+		task->set_cb(&entry->set, task->thunk);
+	}
+}
+
+/*
+ * The single address reported to tasks without DNSTASK_DUAL from a
+ * complete set, the preferred family if resolved.
+ */
+static int
+preferred(struct dnsset *set, void **address)
+{
+
+	if (set->n6 > 0 && (p_family == AF_INET6 || set->n4 == 0)) {
+		*address = &set->addr6[0];
+		return AF_INET6;
+	} else if (set->n4 > 0) {
+		*address = &set->addr4[0];
+		return AF_INET;
+	}
+	*address = NULL;
+	return 0;
+}
+
+/*
+ * Hand the latest result of an entry to subscribers which joined after
+ * it was resolved, the same way it was reported to the others.
+ */
+static void
+replay(int fd, short what, void *thunk)
+{
+	struct dnsentry *entry = thunk;
+	struct dnsset *set = &entry->set;
+	struct dnstask *task, *tmp;
+	struct timeval now;
+	void *address;
+	int af;
+
+	evutil_gettimeofday(&now, NULL);
+	DL_FOREACH_SAFE(entry->tasks, task, tmp) {
+		if (!task->replay)
+			continue;
+		task->replay = 0;
+		timed(task, &now);
+		if (task->flags == DNSTASK_SET) {
+			task->set_cb(set, task->thunk);
+		} else if (task->flags == DNSTASK_DUAL) {
+			if (!v4_flag)
+				task->cb(AF_INET6, set->n6 ?
+				    &set->addr6[0] : NULL, task->thunk);
+			if (!v6_flag)
+				task->cb(AF_INET, set->n4 ?
+				    &set->addr4[0] : NULL, task->thunk);
+			if (!set->n6 && !set->n4)
+				task->cb(0, NULL, task->thunk);
 		} else {
-			/* neg-TTL might be search domain's */
-			reschedule(task->ev_resolve, 60);
-			task->cb(0, NULL, task->thunk);
+			af = preferred(set, &address);
+			task->cb(af, address, task->thunk);
 		}
 	}
 }
 
 /*
- * Send DNS request using evdns. Try IPv6 first unless IPv4 is
- * forced. Missing AAAA-records are handled in response_ipv6.
+ * Check for a response to an entry without subscribers. Its queries
+ * were cancelled and it is freed once the last of them has reported.
+ */
+static int
+orphaned(struct dnsentry *entry)
+{
+
+	if (entry->refcnt > 0)
+		return 0;
+	if (entry->req6 == NULL && entry->req4 == NULL)
+		free(entry);
+	return 1;
+}
+
+/*
+ * Pick the address to report for tasks without DNSTASK_DUAL, once
+ * there is an answer for the preferred family. If it didn't resolve
+ * the other family is used when answered. Returns address family
+ * reported or 0 if still undecided.
+ */
+static int
+pick(struct dnsentry *entry)
+{
+	int pending6 = (entry->req6 != NULL);
+	int pending4 = (entry->req4 != NULL);
+	void *address;
+	int af;
+
+	if (p_family == AF_INET6 ? pending6 : pending4)
+		return 0;
+	af = preferred(&entry->set, &address);
+	if (af == 0 || (af != p_family && (pending6 || pending4)))
+		return 0;
+	publish(entry, 0, af, address);
+	return af;
+}
+
+/*
+ * Result of one of the queries. With DNSTASK_DUAL each family is
+ * reported on its own, with a NULL address if it didn't resolve.
+ * Otherwise a single address is reported, see pick. Once all queries
+ * are answered reschedule, reporting the target unresolved if neither
+ * family resolved, and report all addresses with DNSTASK_SET. All
+ * diagnostics about failed requests (NXDOMAIN, SERVFAIL, at al) are
+ * useless, since they might refer to a search domain request, which is
+ * done transparently after the real request.
  */
 static void
-sendquery(int fd, short what, void *thunk)
+response(struct dnsentry *entry, int af, int result, int count, int ttl,
+    void *addresses)
 {
-	struct dnstask *task = thunk;
+	int ok = (result == DNS_ERR_NONE && count > 0);
+	struct timeval now, tv;
+
+	store(entry, af, addresses, ok ? count : 0);
+	if (ok) {
+		entry->found++;
+		entry->ttl = MIN(entry->ttl, ttl);
+	}
+	publish(entry, DNSTASK_DUAL, af, ok ? addresses : NULL);
+	if (!entry->published)
+		entry->published = pick(entry);
+	if (--entry->pending > 0)
+		return;
+	publish_set(entry);
+	if (entry->found == 0) {
+		entry->refreshing = 0;
+		publish(entry, 0, 0, NULL);
+		publish(entry, DNSTASK_DUAL, 0, NULL);
+		/* neg-TTL might be search domain's */
+		retry(entry);
+		return;
+	}
+	evutil_gettimeofday(&now, NULL);
+	if (entry->refreshing && evutil_timercmp(&now, &entry->stale, >)) {
+		evutil_timersub(&now, &entry->stale, &tv);
+		refresh_late++;
+		refresh_lateness_max = MAX(refresh_lateness_max,
+		    tv.tv_sec * 1000 + tv.tv_usec / 1000);
+	}
+	entry->refreshing = 0;
+	entry->expires = now.tv_sec + entry->ttl;
+	entry->stale = now;
+	entry->stale.tv_sec += entry->ttl;
+	if (T_flag)
+		refresh(entry);
+}
+
+/*
+ * Callback for A-records resolver results.
+ */
+static void
+response_ipv4(int result, char type, int count, int ttl, void *addresses,
+    void *thunk)
+{
+	struct dnsentry *entry = thunk;
+
+	inflight--;
+	entry->req4 = NULL;
+	if (!orphaned(entry))
+		response(entry, AF_INET, result, count, ttl, addresses);
+	admit(-1, 0, NULL);
+}
+
+/*
+ * Callback for AAAA-records resolver results.
+ */
+static void
+response_ipv6(int result, char type, int count, int ttl, void *addresses,
+    void *thunk)
+{
+	struct dnsentry *entry = thunk;
+
+	inflight--;
+	entry->req6 = NULL;
+	if (!orphaned(entry))
+		response(entry, AF_INET6, result, count, ttl, addresses);
+	admit(-1, 0, NULL);
+}
+
+/*
+ * Send DNS requests using evdns. AAAA and A queries are sent at once,
+ * unless a family is forced, so resolving takes a single round trip
+ * also for hostnames lacking the preferred family. A query evdns
+ * refuses is handled as failed.
+ */
+static void
+sendquery(struct dnsentry *entry)
+{
+	struct dnstask *task;
+
+	entry->pending = (v4_flag ? 0 : 1) + (v6_flag ? 0 : 1);
+	entry->found = 0;
+	entry->published = 0;
+	entry->ttl = INT_MAX;
+	DL_FOREACH(entry->tasks, task)
+		task->timed = 0;
 	if (!v4_flag) {
-		evdns_base_resolve_ipv6(dns, task->host, 0,
-		    response_ipv6, task);
+		queries++;
+		inflight++;
+		entry->req6 = evdns_base_resolve_ipv6(dns, entry->host, 0,
+		    response_ipv6, entry);
+		if (entry->req6 == NULL)
+			response_ipv6(DNS_ERR_UNKNOWN, 0, 0, 0, NULL, entry);
+	}
+	if (!v6_flag) {
+		queries++;
+		inflight++;
+		entry->req4 = evdns_base_resolve_ipv4(dns, entry->host, 0,
+		    response_ipv4, entry);
+		if (entry->req4 == NULL)
+			response_ipv4(DNS_ERR_UNKNOWN, 0, 0, 0, NULL, entry);
+	}
+}
+
+/*
+ * Take cost tokens for queries to be sent, if within budget and below
+ * limit of queries in flight. When out of tokens, come back once
+ * enough have accrued. When at the limit, responses resume admission.
+ */
+static int
+budget(int cost, int limit)
+{
+	struct timeval tv;
+	double wait;
+
+	if (inflight > 0 && inflight + cost > limit)
+		return 0;
+	if (Q_rate > 0 && tokens < cost) {
+		wait = (cost - tokens) / Q_rate;
+		evutil_timerclear(&tv);
+		tv.tv_sec = wait;
+		tv.tv_usec = (wait - tv.tv_sec) * 1000000 + 1;
+		event_add(ev_admit, &tv);
+		throttled++;
+		return 0;
+	}
+	tokens -= cost;
+	return 1;
+}
+
+/*
+ * Send queries for queued entries, and then reverse lookups, as far
+ * as budget and limit allow.
+ */
+static void
+admit(int fd, short what, void *thunk)
+{
+	static int admitting;
+	struct dnsentry *entry;
+	struct dnsname *name;
+	int cost = (v4_flag || v6_flag) ? 1 : 2;
+	int q;
+
+	/* failed queries respond synchronously from within sendquery */
+	if (admitting)
+		return;
+	admitting = 1;
+	refill();
+	for (q = QUEUE_UNRESOLVED; q <= QUEUE_REFRESH; q++) {
+		while ((entry = queue[q]) != NULL) {
+			if (!budget(cost, j_inflight))
+				goto out;
+			dequeue(entry);
+			sendquery(entry);
+		}
+	}
+	while ((name = names_queue) != NULL) {
+		if (!budget(1, MAX(j_inflight / 2, 1)))
+			goto out;
+		DL_DELETE(names_queue, name);
+		names_queued--;
+		sendname(name);
+	}
+out:
+	admitting = 0;
+}
+
+/*
+ * Walk the refresh wheel up to the current tick, queueing the entries
+ * due. Ticks run late under load, then all slots passed are walked.
+ */
+static void
+wheel_walk(int fd, short what, void *thunk)
+{
+	struct dnsentry *entry, *tmp;
+	struct timeval now;
+	uint64_t tick, end;
+	int n;
+
+	evutil_gettimeofday(&now, NULL);
+	end = ticks(&now);
+	if (end - wheel_tick >= REFRESH_SLOTS)
+		wheel_tick = end - REFRESH_SLOTS + 1;
+	for (tick = wheel_tick; tick <= end; tick++) {
+		n = 0;
+		DL_FOREACH_SAFE2(wheel[tick % REFRESH_SLOTS], entry, tmp,
+		    wnext) {
+			if (entry->tick > end)
+				continue;
+			wheel_del(entry);
+			entry->refreshing = 1;
+			enqueue(entry);
+			n++;
+		}
+		refreshes += n;
+		refreshed[tick % REFRESH_RATE_TICKS] = n;
+	}
+	wheel_tick = end + 1;
+	admit(-1, 0, NULL);
+}
+
+/*
+ * Hand a name to subscribers, unless the lookup failed.
+ */
+static void
+publish_name(struct dnsname *name)
+{
+	struct dnstask *task, *tmp;
+
+	if (name->name[0] == '\0')
+		return;
+	DL_FOREACH_SAFE(name->tasks, task, tmp)
+		task->name_cb(name->name, task->thunk);
+}
+
+static void
+replay_name(int fd, short what, void *thunk)
+{
+	struct dnsname *name = thunk;
+	struct dnstask *task, *tmp;
+
+	DL_FOREACH_SAFE(name->tasks, task, tmp) {
+		if (!task->replay)
+			continue;
+		task->replay = 0;
+		if (name->name[0] != '\0')
+			task->name_cb(name->name, task->thunk);
+	}
+}
+
+static void
+name_free(struct dnsname *name)
+{
+
+	event_free(name->ev_replay);
+	free(name);
+}
+
+/*
+ * Callback for PTR-records resolver results. A name without
+ * subscribers had its lookup cancelled, and is freed.
+ */
+static void
+response_name(int result, char type, int count, int ttl, void *addresses,
+    void *thunk)
+{
+	struct dnsname *name = thunk;
+
+	inflight--;
+	name->req = NULL;
+	if (name->refcnt == 0) {
+		name_free(name);
 	} else {
-		evdns_base_resolve_ipv4(dns, task->host, 0,
-		    response_ipv4, task);
+		if (result == DNS_ERR_NONE && type == DNS_PTR && count > 0)
+			strncat(name->name, *(char **)addresses,
+			    sizeof(name->name) - 1);
+		name->state = NAME_DONE;
+		publish_name(name);
 	}
+	admit(-1, 0, NULL);
+}
 
+static void
+sendname(struct dnsname *name)
+{
+
+	names_queries++;
+	inflight++;
+	name->state = NAME_INFLIGHT;
+	if (name->af == AF_INET6)
+		name->req = evdns_base_resolve_reverse_ipv6(dns,
+		    &name->addr6, 0, response_name, name);
+	else
+		name->req = evdns_base_resolve_reverse(dns, &name->addr4, 0,
+		    response_name, name);
+	if (name->req == NULL)
+		response_name(DNS_ERR_UNKNOWN, 0, 0, 0, NULL, name);
 }
 
 /*
- * Set up a dnstask for resolving a given hostname and schedule
- * initial resolving.
+ * Resolving of an entry is due, queue it for admission.
  */
-struct dnstask *
-dnstask_new(const char *hostname, dnstask_cb_type cb, void *thunk)
+static void
+due(int fd, short what, void *thunk)
+{
+	struct dnsentry *entry = thunk;
+
+	enqueue(entry);
+	admit(-1, 0, NULL);
+}
+
+static int
+cache_cmp(const void *host, const void *rec)
+{
+
+	return strncmp(host, ((const struct cacherec *)rec)->host, MAXHOST);
+}
+
+/*
+ * Seed a new entry with addresses from the cache. Expired addresses
+ * are used as well, they are likely still right and are resolved again
+ * first thing.
+ */
+static void
+cache_lookup(struct dnsentry *entry)
+{
+	struct cacherec *rec;
+
+	if (cache_recs == NULL)
+		return;
+	rec = bsearch(entry->host, cache_recs, cache_count, sizeof(*rec),
+	    cache_cmp);
+	if (rec == NULL)
+		return;
+	store(entry, AF_INET6, rec->set.addr6, MIN(rec->set.n6, DNSSET_MAX));
+	store(entry, AF_INET, rec->set.addr4, MIN(rec->set.n4, DNSSET_MAX));
+	entry->expires = rec->expires;
+	entry->stale.tv_sec = rec->expires;
+	cache_hits++;
+	if (rec->expires <= time(NULL))
+		cache_stale++; /* not a late refresh */
+	else
+		entry->refreshing = 1;
+}
+
+/*
+ * Set up a new entry for a hostname and queue initial resolving. An
+ * entry found in the cache starts out resolved, and is queued as a
+ * refresh.
+ */
+static struct dnsentry *
+dnsentry_new(const char *hostname)
+{
+	struct dnsentry *entry;
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return NULL;
+	strncat(entry->host, hostname, sizeof(entry->host) - 1);
+	cache_lookup(entry);
+	entry->ev_resolve = event_new(ev_base, -1, 0, due, entry);
+	entry->ev_replay = event_new(ev_base, -1, 0, replay, entry);
+	if (entry->ev_resolve == NULL || entry->ev_replay == NULL) {
+		if (entry->ev_resolve)
+			event_free(entry->ev_resolve);
+		free(entry);
+		return NULL;
+	}
+	HASH_ADD_STR(entries, host, entry);
+	enqueue(entry);
+	event_active(ev_admit, 0, 0);
+	return entry;
+}
+
+/*
+ * Set up timers shared by all entries, on first use.
+ */
+static int
+setup(void)
 {
-	struct dnstask *task;
 	struct timeval tv;
+	char buf[16];
 
+	if (tv_retry == NULL) {
+		evutil_timerclear(&tv);
+		tv.tv_sec = RETRY;
+		tv_retry = event_base_init_common_timeout(ev_base, &tv);
+	}
+	if (ev_admit == NULL) {
+		ev_admit = event_new(ev_base, -1, 0, admit, NULL);
+		if (ev_admit == NULL)
+			return -1;
+		/* don't let evdns hold back what was admitted */
+		snprintf(buf, sizeof(buf), "%d", j_inflight);
+		evdns_base_set_option(dns, "max-inflight:", buf);
+	}
+	if (ev_wheel == NULL) {
+		ev_wheel = event_new(ev_base, -1, EV_PERSIST, wheel_walk,
+		    NULL);
+		if (ev_wheel == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Subscribe to resolving of a given hostname. The first subscriber
+ * sets up the shared entry and schedules initial resolving, later ones
+ * get the latest result replayed if already resolved.
+ */
+static struct dnstask *
+subscribe(const char *hostname, int flags, dnstask_cb_type cb,
+    dnstask_set_cb_type set_cb, void *thunk)
+{
+	struct dnsentry *entry;
+	struct dnstask *task;
+
+	if (setup() < 0)
+		return NULL;
+	assert(strlen(hostname) + 1 <= MAXHOST);
 	task = calloc(1, sizeof(*task));
 	if (task == NULL)
 		return NULL;
-	assert(strlen(hostname) + 1 <= sizeof(task->host));
-	strncat(task->host, hostname, sizeof(task->host) - 1);
+	HASH_FIND_STR(entries, hostname, entry);
+	if (entry == NULL)
+		entry = dnsentry_new(hostname);
+	if (entry == NULL) {
+		free(task);
+		return NULL;
+	}
+	task->flags = flags;
 	task->cb = cb;
+	task->set_cb = set_cb;
 	task->thunk = thunk;
-	task->ev_resolve = event_new(ev_base, -1, 0, sendquery, task);
-	if (task->ev_resolve == NULL) {
-		free(task);
+	task->entry = entry;
+	task->latency = -1;
+	evutil_gettimeofday(&task->since, NULL);
+	if (entry->answered) {
+		task->replay = 1;
+		event_active(entry->ev_replay, 0, 0);
+	}
+	DL_APPEND(entry->tasks, task);
+	entry->refcnt++;
+	subscribers++;
+	return task;
+}
+
+struct dnstask *
+dnstask_new(const char *hostname, int flags, dnstask_cb_type cb,
+    void *thunk)
+{
+
+	return subscribe(hostname, flags & DNSTASK_DUAL, cb, NULL, thunk);
+}
+
+/*
+ * Subscribe to all addresses of a hostname, reported once both
+ * families are answered.
+ */
+struct dnstask *
+dnstask_new_set(const char *hostname, dnstask_set_cb_type cb, void *thunk)
+{
+
+	return subscribe(hostname, DNSTASK_SET, NULL, cb, thunk);
+}
+
+/*
+ * Subscribe to the name of an address, reported if and when a reverse
+ * lookup finds one.
+ */
+struct dnstask *
+dnstask_new_name(int af, void *address, dnstask_name_cb_type cb,
+    void *thunk)
+{
+	struct dnsname *name;
+	struct dnstask *task;
+	char key[INET6_ADDRSTRLEN];
+
+	if (setup() < 0)
+		return NULL;
+	if (evutil_inet_ntop(af, address, key, sizeof(key)) == NULL)
+		return NULL;
+	task = calloc(1, sizeof(*task));
+	if (task == NULL)
 		return NULL;
+	HASH_FIND_STR(names, key, name);
+	if (name == NULL) {
+		name = calloc(1, sizeof(*name));
+		if (name == NULL ||
+		    (name->ev_replay = event_new(ev_base, -1, 0, replay_name,
+		    name)) == NULL) {
+			free(name);
+			free(task);
+			return NULL;
+		}
+		strncat(name->key, key, sizeof(name->key) - 1);
+		name->af = af;
+		if (af == AF_INET6)
+			memcpy(&name->addr6, address, sizeof(name->addr6));
+		else
+			memcpy(&name->addr4, address, sizeof(name->addr4));
+		HASH_ADD_STR(names, key, name);
+		DL_APPEND(names_queue, name);
+		names_queued++;
+		event_active(ev_admit, 0, 0);
+	} else if (name->state == NAME_DONE) {
+		if (name->refcnt == 0) {
+			DL_DELETE(names_lru, name);
+			names_cached--;
+		}
+		names_hits++;
+		task->replay = 1;
+		event_active(name->ev_replay, 0, 0);
 	}
-	evutil_timerclear(&tv);
-	event_add(task->ev_resolve, &tv);
+	task->flags = DNSTASK_NAME;
+	task->name_cb = cb;
+	task->thunk = thunk;
+	task->name = name;
+	task->latency = -1;
+	DL_APPEND(name->tasks, task);
+	name->refcnt++;
 	return task;
 }
 
 /*
- * Remove and free a previous dnstask.
+ * The last subscriber of a name left. A name looked up goes to the
+ * front of the LRU, evicting the least recently used beyond
+ * NAME_CACHE. Otherwise it is dropped, cancelling a pending lookup.
+ */
+static void
+unsubscribe_name(struct dnsname *name)
+{
+	struct dnsname *last;
+
+	if (name->state == NAME_DONE) {
+		DL_PREPEND(names_lru, name);
+		if (++names_cached > NAME_CACHE) {
+			last = names_lru->prev;
+			DL_DELETE(names_lru, last);
+			names_cached--;
+			HASH_DELETE(hh, names, last);
+			name_free(last);
+		}
+		return;
+	}
+	HASH_DELETE(hh, names, name);
+	if (name->state == NAME_QUEUED) {
+		DL_DELETE(names_queue, name);
+		names_queued--;
+		name_free(name);
+	} else {
+		/* freed as the cancelled lookup reports back */
+		evdns_cancel_request(dns, name->req);
+	}
+}
+
+/*
+ * Remove and free a previous dnstask. When the last subscriber of a
+ * hostname leaves, pending queries are cancelled and the entry is
+ * released.
  */
 void
 dnstask_free(struct dnstask *task)
 {
-	event_free(task->ev_resolve);
+	struct dnsentry *entry = task->entry;
+	struct dnsname *name = task->name;
+
+	if (name != NULL) {
+		DL_DELETE(name->tasks, task);
+		free(task);
+		if (--name->refcnt == 0)
+			unsubscribe_name(name);
+		return;
+	}
+	DL_DELETE(entry->tasks, task);
 	free(task);
+	subscribers--;
+	if (--entry->refcnt > 0)
+		return;
+	HASH_DELETE(hh, entries, entry);
+	dequeue(entry);
+	wheel_del(entry);
+	event_free(entry->ev_resolve);
+	event_free(entry->ev_replay);
+	/* cancelled queries still report back, see orphaned */
+	if (entry->req6)
+		evdns_cancel_request(dns, entry->req6);
+	if (entry->req4)
+		evdns_cancel_request(dns, entry->req4);
+	if (entry->req6 == NULL && entry->req4 == NULL)
+		free(entry);
+}
+
+/*
+ * Map a cache file written by dnstask_save. A missing file is not an
+ * error, it is created on exit. Returns -1 if the file is unusable.
+ */
+int
+dnstask_load(const char *filename)
+{
+	struct cachehdr *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	hdr = map;
+	if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+	    hdr->recsize != sizeof(struct cacherec) ||
+	    (st.st_size - sizeof(*hdr)) / sizeof(struct cacherec) <
+	    hdr->count) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	cache_map = map;
+	cache_len = st.st_size;
+	cache_recs = (struct cacherec *)(hdr + 1);
+	cache_count = hdr->count;
+	return 0;
+}
+
+static int
+cacherec_cmp(const void *a, const void *b)
+{
+
+	return strncmp(((const struct cacherec *)a)->host,
+	    ((const struct cacherec *)b)->host, MAXHOST);
+}
+
+/*
+ * Write resolved entries to a cache file, expired ones too, replacing
+ * it atomically. Releases a previously loaded cache.
+ */
+int
+dnstask_save(const char *filename)
+{
+	struct dnsentry *entry, *tmp;
+	struct cacherec *recs;
+	struct cachehdr hdr;
+	char tmpname[PATH_MAX];
+	FILE *f;
+	int n = 0;
+
+	if (cache_map != NULL) {
+		munmap(cache_map, cache_len);
+		cache_map = NULL;
+		cache_recs = NULL;
+	}
+	recs = calloc(HASH_COUNT(entries) + 1, sizeof(*recs));
+	if (recs == NULL)
+		return -1;
+	HASH_ITER(hh, entries, entry, tmp) {
+		if (!entry->set.n6 && !entry->set.n4)
+			continue;
+		memcpy(recs[n].host, entry->host, sizeof(recs[n].host));
+		recs[n].expires = entry->expires;
+		recs[n].set = entry->set;
+		n++;
+	}
+	qsort(recs, n, sizeof(*recs), cacherec_cmp);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.recsize = sizeof(struct cacherec);
+	hdr.count = n;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	f = fopen(tmpname, "w");
+	if (f == NULL) {
+		free(recs);
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(recs, sizeof(*recs), n, f) != (size_t)n) {
+		fclose(f);
+		unlink(tmpname);
+		free(recs);
+		return -1;
+	}
+	free(recs);
+	if (fclose(f) != 0 || rename(tmpname, filename) < 0) {
+		unlink(tmpname);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Latest resolution latency of a task in microseconds, -1 if not yet
+ * resolved.
+ */
+long
+dnstask_latency(struct dnstask *task)
+{
+
+	return task->latency;
+}
+
+void
+dnstask_stats(stats_cb_type cb, void *thunk)
+{
+	unsigned long rate = 0;
+	int i;
+
+	for (i = 0; i < REFRESH_RATE_TICKS; i++)
+		rate += refreshed[i];
+
+	cb("dns_hostnames", HASH_COUNT(entries), thunk);
+	cb("dns_subscribers", subscribers, thunk);
+	cb("dns_queries", queries, thunk);
+	cb("dns_resolutions", resolutions, thunk);
+	cb("dns_latency_avg_us", resolutions ? latency_sum / resolutions : 0,
+	    thunk);
+	cb("dns_latency_max_us", latency_max, thunk);
+	cb("dns_inflight", inflight, thunk);
+	cb("dns_queue_unresolved", depth[QUEUE_UNRESOLVED], thunk);
+	cb("dns_queue_refresh", depth[QUEUE_REFRESH], thunk);
+	cb("dns_queue_max", depth_max, thunk);
+	cb("dns_throttled", throttled, thunk);
+	cb("dns_refreshes", refreshes, thunk);
+	cb("dns_refresh_rate", rate, thunk);
+	cb("dns_refresh_late", refresh_late, thunk);
+	cb("dns_refresh_lateness_max_ms", refresh_lateness_max, thunk);
+	cb("dns_names", HASH_COUNT(names), thunk);
+	cb("dns_names_cached", names_cached, thunk);
+	cb("dns_names_queue", names_queued, thunk);
+	cb("dns_names_queries", names_queries, thunk);
+	cb("dns_names_hits", names_hits, thunk);
+	cb("dns_cache_records", cache_count, thunk);
+	cb("dns_cache_hits", cache_hits, thunk);
+	cb("dns_cache_stale", cache_stale, thunk);
 }
@@ -7,11 +7,14 @@
  * ----------------------------------------------------------------------------
  */
 
+#include <sys/socket.h>
+
 #include <errno.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <event2/event.h>
 #ifdef WITH_SSL
@@ -23,11 +26,21 @@
 #include <event2/util.h>
 #include "xping.h"
 
+extern int E_flag;
+extern int F_flag;
+extern int R_flag;
+extern int p_family;
+extern int P_lo, P_hi;
+
 struct probe {
 	char		host[MAXHOST];
 	int		resolved;
-	union addr	sa;
+	in_port_t	port;
+	union addr	sa6;
+	union addr	sa4;
+	int		af_won;
 	char		query[64];
+	int		fastopen;
 #ifdef WITH_SSL
 	SSL_CTX		*ssl_ctx;
 #endif /* WITH_SSL */
@@ -39,39 +52,265 @@ struct probe {
 struct session {
 	struct probe	*prb;
 	int		seq;
+	int		af;
+	int		fd;
 	struct bufferevent *bev;
+	int		fd_race;
+	struct bufferevent *bev_race;
 	struct event	*ev_timeout;
-	char		*statusline;
+	struct event	*ev_race;
+	int		dual;
+	int		racing;
+	int		connected;
 	int		completed;
-#ifdef WITH_SSL
-	SSL		*ssl;
-#endif /* WITH_SSL */
 	struct session	*next;
 };
 
+/*
+ * Source ports of the -P range bound by our open sockets. The kernel
+ * would let SO_REUSEADDR bind such a port too, only to fail the
+ * connect with EADDRNOTAVAIL when the destination is the same.
+ */
+static unsigned char portheld[65536 / 8];
+
+#define PORT_HELD(p)	(portheld[(p) / 8] & (1 << ((p) % 8)))
+#define PORT_HOLD(p)	(portheld[(p) / 8] |= 1 << ((p) % 8))
+#define PORT_RELEASE(p)	(portheld[(p) / 8] &= ~(1 << ((p) % 8)))
+
+/*
+ * Socket state counters, used to keep an eye on the local port budget
+ * when probing at high rates. Sockets connecting is the difference
+ * between open and established.
+ */
+static struct {
+	unsigned long	open;
+	unsigned long	established;
+	unsigned long	opened;
+	unsigned long	closed_fin;
+	unsigned long	closed_rst;
+	unsigned long	bind_errors;
+	unsigned long	port_retries;
+	unsigned long	fastopen_syn_data;
+	unsigned long	fastopen_fallback;
+} sockstat;
+
+/*
+ * Outcome of IPv6/IPv4 connection races.
+ */
+static struct {
+	unsigned long	won_ipv6;
+	unsigned long	won_ipv4;
+} racestat;
+
+/*
+ * Sessions are carved out of slabs and recycled through a free list,
+ * each keeping its timeout and race events across uses. Slabs are only released
+ * by probe_cleanup.
+ */
+#define SESSION_SLAB 64
+
+struct session_slab {
+	struct session		sessions[SESSION_SLAB];
+	struct session_slab	*next;
+};
+
+const int probe_tcp = 1;
+
+static struct session_slab *slabs = NULL;
+static struct session *session_freelist = NULL;
+
 static regex_t re_target;
 static struct timeval tv_timeout;
+static const struct timeval *tv_timeout_common;
+static const struct timeval *tv_race_common;
 static void session_eventcb(struct bufferevent *, short, void *);
+static void session_readcb_status(struct bufferevent *, void *);
 static void session_readcb_drain(struct bufferevent *, void *);
+static void session_timeout(int, short, void *);
+static void session_race(int, short, void *);
+
+/*
+ * Delay before racing IPv4 against a pending IPv6 connection attempt,
+ * "Connection Attempt Delay" of RFC 8305.
+ */
+#define RACE_DELAY 250 /* ms */
+
+/*
+ * Take a session from the free list, growing it by a slab when empty.
+ * All fields but the timeout and race events are reset.
+ */
+static struct session *
+session_new(void)
+{
+	struct session_slab *slab;
+	struct session *session;
+	struct event *ev_timeout;
+	struct event *ev_race;
+	int i;
+
+	if (session_freelist == NULL) {
+		slab = calloc(1, sizeof(*slab));
+		if (slab == NULL)
+			return NULL;
+		LL_PREPEND(slabs, slab);
+		for (i = 0; i < SESSION_SLAB; i++)
+			LL_PREPEND(session_freelist, &slab->sessions[i]);
+	}
+	session = session_freelist;
+	if (session->ev_timeout == NULL) {
+		session->ev_timeout = event_new(ev_base, -1, 0,
+		    session_timeout, session);
+		if (session->ev_timeout == NULL)
+			return NULL;
+	}
+	if (session->ev_race == NULL) {
+		session->ev_race = event_new(ev_base, -1, 0,
+		    session_race, session);
+		if (session->ev_race == NULL)
+			return NULL;
+	}
+	LL_DELETE(session_freelist, session);
+	ev_timeout = session->ev_timeout;
+	ev_race = session->ev_race;
+	memset(session, 0, sizeof(*session));
+	session->ev_timeout = ev_timeout;
+	session->ev_race = ev_race;
+	session->fd = -1;
+	session->fd_race = -1;
+	return session;
+}
+
+/*
+ * Close a connection attempt. bufferevent_free is responsible for
+ * closing the actual socket, unless the socket never made it into a
+ * bufferevent. With -R the socket is closed with an abortive close
+ * (RST) to avoid leaving it in TIME_WAIT.
+ */
+static void
+session_close(int fd, struct bufferevent *bev, int connected)
+{
+	struct linger linger;
+	union addr sa;
+	socklen_t salen;
+
+	if (fd < 0)
+		return;
+	if (P_lo > 0) {
+		salen = sizeof(sa);
+		if (getsockname(fd, &sa.sa, &salen) == 0)
+			PORT_RELEASE(ntohs(sa.sa.sa_family == AF_INET6 ?
+			    sa.sin6.sin6_port : sa.sin.sin_port));
+	}
+	if (R_flag) {
+		linger.l_onoff = 1;
+		linger.l_linger = 0;
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger,
+		    sizeof(linger));
+		sockstat.closed_rst++;
+	} else {
+		sockstat.closed_fin++;
+	}
+	if (connected)
+		sockstat.established--;
+	sockstat.open--;
+	if (bev) {
+		bufferevent_disable(bev, EV_READ|EV_WRITE);
+		bufferevent_free(bev);
+	} else {
+		evutil_closesocket(fd);
+	}
+}
 
 /*
- * Drop a session and free the associated state. bufferevent_free is
- * responsible for closing the actual socket
+ * Drop a session and free the associated state, returning it to the
+ * free list.
  */
 static void
 session_free(struct session *session)
 {
 
-	if (session->statusline)
-		free(session->statusline);
 	LL_DELETE(session->prb->sessions, session);
-	if (session->ev_timeout)
-		event_free(session->ev_timeout);
-	if (session->bev) {
-		bufferevent_disable(session->bev, EV_READ|EV_WRITE);
-		bufferevent_free(session->bev);
+	event_del(session->ev_timeout);
+	event_del(session->ev_race);
+	session_close(session->fd, session->bev, session->connected);
+	session_close(session->fd_race, session->bev_race, 0);
+	LL_PREPEND(session_freelist, session);
+}
+
+/*
+ * Account for a session which completed its connect. With fast open
+ * the first sign of this is the response arriving.
+ */
+static void
+session_established(struct session *session)
+{
+
+	if (session->connected)
+		return;
+	session->connected = 1;
+	sockstat.established++;
+}
+
+/*
+ * Open a nonblocking socket for a session. When a source port range is
+ * given (-P), bind to the next port of the range in a round robin
+ * fashion, skipping ports held by our other sessions or by other
+ * sockets. Ports left in TIME_WAIT by earlier sessions are reused, as
+ * without -R every port would be held for a minute after its session.
+ */
+static int
+session_socket(int af)
+{
+	static int portnext = 0;
+	union addr sa;
+	int salen;
+	int port;
+	int fd;
+	int on;
+	int i;
+
+	fd = socket(af, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (evutil_make_socket_nonblocking(fd) < 0) {
+		evutil_closesocket(fd);
+		return -1;
+	}
+	if (P_lo > 0) {
+		on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		memset(&sa, 0, sizeof(sa));
+		salen = af == AF_INET6 ? sizeof(struct sockaddr_in6) :
+		    sizeof(struct sockaddr_in);
+		for (i = P_lo; i <= P_hi; i++) {
+			port = P_lo + portnext;
+			portnext = (portnext + 1) % (P_hi - P_lo + 1);
+			if (PORT_HELD(port))
+				continue;
+			if (af == AF_INET6) {
+				sa.sin6.sin6_family = AF_INET6;
+				sa.sin6.sin6_port = htons(port);
+			} else {
+				sa.sin.sin_family = AF_INET;
+				sa.sin.sin_port = htons(port);
+			}
+			if (bind(fd, &sa.sa, salen) == 0) {
+				PORT_HOLD(port);
+				break;
+			}
+			if (errno != EADDRINUSE)
+				i = P_hi;
+		}
+		if (i > P_hi) {
+			sockstat.bind_errors++;
+			errno = EADDRINUSE;
+			evutil_closesocket(fd);
+			return -1;
+		}
 	}
-	free(session);
+	sockstat.open++;
+	sockstat.opened++;
+	return fd;
 }
 
 /*
@@ -89,11 +328,282 @@ session_send(struct session *session)
 	    "\r\n", session->prb->query, session->prb->host, version);
 }
 
+#ifdef MSG_FASTOPEN
+/*
+ * Connect using TCP Fast Open (-F), placing the request in the SYN when
+ * the kernel has a cookie cached for the server. Without a cookie a
+ * plain SYN is sent and the request stays in the output buffer until
+ * the connection is established. As the request is queued up front,
+ * BEV_EVENT_CONNECTED is never reported for these sessions. Where fast
+ * open isn't available, e.g. disabled by sysctl, the request is taken
+ * back and the session connects as without it.
+ */
+static int
+session_connect_fastopen(struct session *session, union addr *sa, int salen)
+{
+	struct evbuffer *evbuf = bufferevent_get_output(session->bev);
+	size_t len;
+	ssize_t n;
+
+	bufferevent_disable(session->bev, EV_WRITE);
+	session_send(session);
+	len = evbuffer_get_length(evbuf);
+	n = sendto(session->fd, evbuffer_pullup(evbuf, len), len,
+	    MSG_FASTOPEN, &sa->sa, salen);
+	if (n >= 0) {
+		evbuffer_drain(evbuf, n);
+		sockstat.fastopen_syn_data++;
+	} else if (errno == EINPROGRESS) {
+		sockstat.fastopen_fallback++;
+	} else if (errno == EOPNOTSUPP || errno == ENOPROTOOPT) {
+		sockstat.fastopen_fallback++;
+		evbuffer_drain(evbuf, len);
+		bufferevent_enable(session->bev, EV_WRITE);
+		return bufferevent_socket_connect(session->bev, &sa->sa,
+		    salen);
+	} else {
+		return -1;
+	}
+	bufferevent_enable(session->bev, EV_WRITE);
+	return 0;
+}
+#endif /* MSG_FASTOPEN */
+
+/*
+ * Start a connection attempt towards an address, storing socket and
+ * bufferevent in fdp and bevp. On failure these may be partially set
+ * up, and are left for session_close.
+ */
+static int
+session_open(struct session *session, union addr *sa, int *fdp,
+    struct bufferevent **bevp)
+{
+	struct probe *prb = session->prb;
+	struct bufferevent *bev;
+#ifdef WITH_SSL
+	SSL *ssl;
+#endif /* WITH_SSL */
+	int salen;
+	int fd;
+
+	fd = session_socket(sa->sa.sa_family);
+	if (fd < 0)
+		return -1;
+	*fdp = fd;
+#ifdef WITH_SSL
+	if (prb->ssl_ctx != NULL) {
+		ssl = SSL_new(prb->ssl_ctx);
+		if (ssl == NULL)
+			return -1;
+		bev = bufferevent_openssl_socket_new(ev_base, fd, ssl,
+		    BUFFEREVENT_SSL_CONNECTING,
+		    BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
+		if (bev == NULL)
+			SSL_free(ssl);
+	} else {
+		bev = bufferevent_socket_new(ev_base, fd,
+		    BEV_OPT_CLOSE_ON_FREE);
+	}
+#else /* !WITH_SSL */
+	bev = bufferevent_socket_new(ev_base, fd, BEV_OPT_CLOSE_ON_FREE);
+#endif
+	if (bev == NULL)
+		return -1;
+	*bevp = bev;
+	bufferevent_setcb(bev, session_readcb_status, NULL, session_eventcb,
+	    session);
+	bufferevent_enable(bev, EV_READ);
+	bufferevent_setwatermark(bev, EV_READ, 0, 4096);
+	salen = sa->sa.sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+	    sizeof(struct sockaddr_in);
+#ifdef MSG_FASTOPEN
+	if (prb->fastopen && !session->dual)
+		return session_connect_fastopen(session, sa, salen);
+#endif /* MSG_FASTOPEN */
+	return bufferevent_socket_connect(bev, &sa->sa, salen);
+}
+
+/*
+ * Start a connection attempt as session_open does. With -P the port
+ * bound may still belong to a socket towards the same address, as
+ * bufferevent_free leaves closing the socket for later. The connect
+ * then fails with EADDRNOTAVAIL and is retried with the next port.
+ */
+static int
+session_connect(struct session *session, union addr *sa, int *fdp,
+    struct bufferevent **bevp)
+{
+	int tries;
+	int n;
+
+	for (tries = 0; ; tries++) {
+		n = session_open(session, sa, fdp, bevp);
+		if (n == 0 || errno != EADDRNOTAVAIL || P_lo == 0 ||
+		    tries >= P_hi - P_lo)
+			return n;
+		sockstat.port_retries++;
+		session_close(*fdp, *bevp, 0);
+		*fdp = -1;
+		*bevp = NULL;
+	}
+}
+
+/*
+ * Address of a probe for a given family.
+ */
+static union addr *
+probe_addr(struct probe *prb, int af)
+{
+
+	return af == AF_INET6 ? &prb->sa6 : &prb->sa4;
+}
+
+/*
+ * Network address of a probe for a given family.
+ */
+static void *
+probe_inaddr(struct probe *prb, int af)
+{
+
+	if (af == AF_INET6)
+		return &prb->sa6.sin6.sin6_addr;
+	return &prb->sa4.sin.sin_addr;
+}
+
+#define OTHER_AF(af) ((af) == AF_INET6 ? AF_INET : AF_INET6)
+
+/*
+ * Start the attempt for the other family of a session racing IPv6
+ * against IPv4. If it can't be started the first attempt continues
+ * alone.
+ */
+static void
+session_race(int fd, short what, void *thunk)
+{
+	struct session *session = thunk;
+
+	if (session_connect(session, probe_addr(session->prb,
+	    OTHER_AF(session->af)), &session->fd_race,
+	    &session->bev_race) < 0) {
+		session_close(session->fd_race, session->bev_race, 0);
+		session->fd_race = -1;
+		session->bev_race = NULL;
+		session->racing = 0;
+	}
+}
+
+/*
+ * Handle events of a session racing IPv6 against IPv4. When either
+ * attempt connects the other is dropped and the session continues as
+ * usual. A failing first attempt starts the attempt for the other
+ * family right away if not yet started. Returns 1 if the event was
+ * consumed by the race.
+ */
+static int
+session_race_event(struct session *session, struct bufferevent *bev,
+    short what)
+{
+	int race = (bev == session->bev_race);
+
+	if (what & BEV_EVENT_CONNECTED) {
+		if (race) {
+			session_close(session->fd, session->bev, 0);
+			session->fd = session->fd_race;
+			session->bev = session->bev_race;
+			session->af = OTHER_AF(session->af);
+		} else {
+			session_close(session->fd_race, session->bev_race, 0);
+		}
+		session->fd_race = -1;
+		session->bev_race = NULL;
+		session->racing = 0;
+		event_del(session->ev_race);
+		return 0;
+	}
+	if (!(what & (BEV_EVENT_ERROR | BEV_EVENT_EOF)))
+		return 0;
+	session->racing = 0;
+	if (race) {
+		/* second attempt lost, first continues alone */
+		session_close(session->fd_race, session->bev_race, 0);
+		session->fd_race = -1;
+		session->bev_race = NULL;
+		return 1;
+	}
+	session_close(session->fd, session->bev, 0);
+	session->af = OTHER_AF(session->af);
+	if (session->bev_race) {
+		/* first attempt lost, second continues alone */
+		session->fd = session->fd_race;
+		session->bev = session->bev_race;
+		session->fd_race = -1;
+		session->bev_race = NULL;
+		return 1;
+	}
+	/* first attempt lost before the second was started, start it now */
+	event_del(session->ev_race);
+	session->fd = -1;
+	session->bev = NULL;
+	if (session_connect(session, probe_addr(session->prb, session->af),
+	    &session->fd, &session->bev) < 0) {
+		target_mark(session->prb->owner, session->seq, '#');
+		session_free(session);
+	}
+	return 1;
+}
+
+/*
+ * Register which family won a race, updating the target's family.
+ */
+static void
+session_race_won(struct session *session)
+{
+	struct probe *prb = session->prb;
+
+	if (session->af == AF_INET6)
+		racestat.won_ipv6++;
+	else
+		racestat.won_ipv4++;
+	if (prb->af_won != session->af) {
+		prb->af_won = session->af;
+		target_resolved(prb->owner, session->af,
+		    probe_inaddr(prb, session->af));
+	}
+}
+
+/*
+ * Extract the status code from a response status line, e.g. "HTTP/1.1
+ * 200 OK". Returns -1 if the line doesn't hold protocol, code and
+ * reason separated by spaces.
+ */
+static int
+parse_status(const char *line, size_t len)
+{
+	const char *end = line + len;
+	const char *number;
+	const char *p;
+	int code;
+
+	number = memchr(line, ' ', len);
+	if (number == NULL)
+		return -1;
+	number++;
+	p = memchr(number, ' ', end - number);
+	if (p == NULL)
+		return -1;
+	for (code = 0; number < p && *number >= '0' && *number <= '9';
+	    number++)
+		code = code * 10 + *number - '0';
+	return code;
+}
+
 /*
- * Read response status. Attempt to read the status line, but if CRLF
+ * Read response status. Attempt to locate the status line, but if CRLF
  * can not be found in the first 2048 bytes, consider it an error and
- * disconnect. Once status line is read switch to draining the rest of
- * the data. The server should close the connection due to
+ * disconnect. The line is parsed in place using evbuffer_peek, only
+ * falling back to copying its beginning onto the stack when it spans
+ * several chains. Once status line is read switch to draining the rest
+ * of the data. The server should close the connection due to
  * "Connection: close" header otherwise it will be caught by timeout.
  *
  * Even though status line says 200, the actual success is registered
@@ -104,34 +614,35 @@ session_readcb_status(struct bufferevent *bev, void *thunk)
 {
 	struct session *session = thunk;
 	struct evbuffer *evbuf = bufferevent_get_input(bev);
+	struct evbuffer_ptr eol;
+	struct evbuffer_iovec vec;
+	char buf[64];
+	const char *line;
 	size_t len;
-	char *line;
-	char *protocol;
-	char *number;
+	int code;
 
-	line = evbuffer_readln(evbuf, &len, EVBUFFER_EOL_CRLF);
-	if (line == NULL) {
+	session_established(session);
+	eol = evbuffer_search_eol(evbuf, NULL, NULL, EVBUFFER_EOL_CRLF);
+	if (eol.pos == -1) {
 		if (evbuffer_get_length(evbuf) > 2048) {
 			session_free(session);
 			return;
 		} else
 			return; /* wait for more data */
 	}
-	session->statusline = line;
-	/* Parse response line */
-	protocol = strsep(&line, " ");
-	if (line == NULL) {
-		session_free(session);
-		return;
+	len = eol.pos;
+	if (evbuffer_peek(evbuf, len, NULL, &vec, 1) == 1) {
+		line = vec.iov_base;
+	} else {
+		len = evbuffer_copyout(evbuf, buf, MIN(len, sizeof(buf)));
+		line = buf;
 	}
-	number = strsep(&line, " ");
-	if (line == NULL) {
+	code = parse_status(line, len);
+	if (code < 0) {
 		session_free(session);
 		return;
 	}
-	(void)protocol;
-	(void)number;
-	if (atoi(number) < 400 && atoi(number) >= 200 ) {
+	if (code < 400 && code >= 200) {
 		session->completed = 1;
 	} else {
 		target_mark(session->prb->owner, session->seq, '%');
@@ -164,8 +675,14 @@ static void
 session_eventcb(struct bufferevent *bev, short what, void *thunk)
 {
 	struct session *session = thunk;
+
+	if (session->racing && session_race_event(session, bev, what))
+		return;
 	switch (what & ~(BEV_EVENT_READING|BEV_EVENT_WRITING)) {
 	case BEV_EVENT_CONNECTED:
+		if (session->dual)
+			session_race_won(session);
+		session_established(session);
 		session_send(session);
 		return;
 	case BEV_EVENT_EOF:
@@ -202,26 +719,68 @@ session_timeout(int fd, short what, void *thunk)
 }
 
 /*
- * Resolving of target complete store resolved address.
+ * Store the address of a family, or clear it if address is NULL.
  */
 static void
-resolved(int af, void *address, void *thunk)
+probe_setaddr(struct probe *prb, int af, void *address)
 {
-	struct probe *prb = thunk;
 	if (af == AF_INET6) {
-		sin6(prb)->sin6_family = AF_INET6;
-		memmove(&sin6(prb)->sin6_addr, (struct in6_addr *)address,
-		    sizeof(sin6(prb)->sin6_addr));
-		prb->resolved = 1;
+		memset(&prb->sa6, 0, sizeof(prb->sa6));
+		if (address == NULL)
+			return;
+		prb->sa6.sin6.sin6_family = AF_INET6;
+		prb->sa6.sin6.sin6_port = prb->port;
+		memmove(&prb->sa6.sin6.sin6_addr, (struct in6_addr *)address,
+		    sizeof(prb->sa6.sin6.sin6_addr));
 	} else if (af == AF_INET) {
-		sin(prb)->sin_family = AF_INET;
-		memmove(&sin(prb)->sin_addr, (struct in_addr *)address,
-		    sizeof(sin(prb)->sin_addr));
-		prb->resolved = 1;
+		memset(&prb->sa4, 0, sizeof(prb->sa4));
+		if (address == NULL)
+			return;
+		prb->sa4.sin.sin_family = AF_INET;
+		prb->sa4.sin.sin_port = prb->port;
+		memmove(&prb->sa4.sin.sin_addr, (struct in_addr *)address,
+		    sizeof(prb->sa4.sin.sin_addr));
+	}
+}
+
+/*
+ * Resolving of target complete store resolved address. Both families
+ * are resolved (DNSTASK_DUAL), each reported on its own. The target is
+ * shown with the preferred family when both are known.
+ */
+static void
+resolved(int af, void *address, void *thunk)
+{
+	struct probe *prb = thunk;
+
+	if (af == AF_INET6 || af == AF_INET) {
+		probe_setaddr(prb, af, address);
 	} else if (af == 0) {
-		prb->resolved = 0;
+		probe_setaddr(prb, AF_INET6, NULL);
+		probe_setaddr(prb, AF_INET, NULL);
 	}
-	target_resolved(prb->owner, af, address);
+	if (probe_addr(prb, p_family)->sa.sa_family == p_family)
+		af = p_family;
+	else if (prb->sa6.sa.sa_family == AF_INET6)
+		af = AF_INET6;
+	else if (prb->sa4.sa.sa_family == AF_INET)
+		af = AF_INET;
+	else
+		af = 0;
+	prb->resolved = (af != 0);
+	prb->af_won = 0;
+	target_resolved(prb->owner, af, af != 0 ? probe_inaddr(prb, af) : NULL);
+}
+
+/*
+ * Expanded hostname (-E), each address is probed as a target of its own.
+ */
+static void
+resolved_set(struct dnsset *set, void *thunk)
+{
+	struct probe *prb = thunk;
+
+	target_expand(prb->owner, set);
 }
 
 /*
@@ -243,8 +802,21 @@ resolved(int af, void *address, void *thunk)
 void
 probe_setup()
 {
+	static struct timeval tv;
+
 	tv_timeout.tv_sec = 3 * i_interval / 1000;
 	tv_timeout.tv_usec = 3 * i_interval % 1000 * 1000;
+	/* All sessions share the timeout, use a common timeout queue with
+	 * O(1) insert and removal instead of the timer heap. */
+	tv_timeout_common = event_base_init_common_timeout(ev_base,
+	    &tv_timeout);
+	if (tv_timeout_common == NULL)
+		tv_timeout_common = &tv_timeout;
+	tv.tv_sec = 0;
+	tv.tv_usec = RACE_DELAY * 1000;
+	tv_race_common = event_base_init_common_timeout(ev_base, &tv);
+	if (tv_race_common == NULL)
+		tv_race_common = &tv;
 	if (regcomp(&re_target, "^(https?:(//)?)?"
             "([0-9A-Za-z.-]+)(\\[([0-9A-Fa-f.:]+)\\])?(:[0-9]+)?(/[^ ]*)?$",
 	    REG_EXTENDED | REG_NEWLINE) != 0) {
@@ -260,8 +832,21 @@ probe_setup()
 void
 probe_cleanup(void)
 {
+	struct session_slab *slab, *slab_tmp;
+	int i;
 
 	regfree(&re_target);
+	LL_FOREACH_SAFE(slabs, slab, slab_tmp) {
+		for (i = 0; i < SESSION_SLAB; i++) {
+			if (slab->sessions[i].ev_timeout)
+				event_free(slab->sessions[i].ev_timeout);
+			if (slab->sessions[i].ev_race)
+				event_free(slab->sessions[i].ev_race);
+		}
+		free(slab);
+	}
+	slabs = NULL;
+	session_freelist = NULL;
 }
 
 /*
@@ -327,10 +912,14 @@ probe_new(const char *line, void *owner)
 		return (prb);
 	}
 	prb->owner = owner;
+#ifdef MSG_FASTOPEN
+	prb->fastopen = F_flag;
+#endif /* MSG_FASTOPEN */
 
 	if (line[match[RE_PROTO].rm_so + 4] == 's') {
 #ifdef WITH_SSL
 		long ssl_options;
+		prb->fastopen = 0; /* request isn't plain text */
 		prb->ssl_ctx = SSL_CTX_new(SSLv23_method());
 		if (prb->ssl_ctx == NULL) {
 			perror("probe_add: SSL_CTX_new");
@@ -357,6 +946,7 @@ probe_new(const char *line, void *owner)
 #endif /* !WITH_SSL */
 	else
 		port = 80;
+	prb->port = htons(port);
 
 	/* prb->query NULL termination is provided by calloc */
 	if (match[RE_URL].rm_so != -1)
@@ -388,15 +978,11 @@ probe_new(const char *line, void *owner)
 		    MIN(sizeof(forced) - 1,
 		    match[RE_FORCED].rm_eo - match[RE_FORCED].rm_so));
 		if (evutil_parse_sockaddr_port(forced, &sa.sa, &salen) == 0) {
-			sa(prb)->sa_family = sa.sa.sa_family;
-			if (sa.sa.sa_family == AF_INET6) {
-				memcpy(&sin6(prb)->sin6_addr,
-				    &sa.sin6.sin6_addr,
-				    sizeof(sin6(prb)->sin6_addr));
-			} else {
-				memcpy(&sin(prb)->sin_addr, &sa.sin.sin_addr,
-				    sizeof(sin(prb)->sin_addr));
-			}
+			if (sa.sa.sa_family == AF_INET6)
+				probe_setaddr(prb, AF_INET6,
+				    &sa.sin6.sin6_addr);
+			else
+				probe_setaddr(prb, AF_INET, &sa.sin.sin_addr);
 			prb->resolved = 1;
 		} else {
 			fprintf(stderr, "probe_add: can't parse %.128s\n",
@@ -408,25 +994,52 @@ probe_new(const char *line, void *owner)
 		salen = sizeof(sa);
 		if (evutil_parse_sockaddr_port(prb->host, &sa.sa,
 		    &salen) == 0) {
-			sa(prb)->sa_family = sa.sa.sa_family;
-			if (sa.sa.sa_family == AF_INET6) {
-				memcpy(&sin6(prb)->sin6_addr,
-				    &sa.sin6.sin6_addr,
-				    sizeof(sin6(prb)->sin6_addr));
-			} else {
-				memcpy(&sin(prb)->sin_addr, &sa.sin.sin_addr,
-				    sizeof(sin(prb)->sin_addr));
-			}
+			if (sa.sa.sa_family == AF_INET6)
+				probe_setaddr(prb, AF_INET6,
+				    &sa.sin6.sin6_addr);
+			else
+				probe_setaddr(prb, AF_INET, &sa.sin.sin_addr);
 			prb->resolved = 1;
 		} else {
-			prb->dnstask = dnstask_new(prb->host, resolved, prb);
+			if (E_flag)
+				prb->dnstask = dnstask_new_set(prb->host,
+				    resolved_set, prb);
+			else
+				prb->dnstask = dnstask_new(prb->host,
+				    DNSTASK_DUAL, resolved, prb);
 			if (prb->dnstask == NULL) {
 				free(prb);
 				return NULL;
 			}
 		}
 	}
-	sin(prb)->sin_port = htons(port);
+	return (prb);
+}
+
+/*
+ * Probe for an address of an expanded hostname, requesting the same
+ * url as the hostname's probe.
+ */
+struct probe *
+probe_new_sub(struct probe *parent, int af, void *address, void *owner)
+{
+	struct probe *prb;
+
+	prb = calloc(1, sizeof(*prb));
+	if (prb == NULL) {
+		perror("probe_add: calloc");
+		return (prb);
+	}
+	memcpy(prb->host, parent->host, sizeof(prb->host));
+	memcpy(prb->query, parent->query, sizeof(prb->query));
+	prb->port = parent->port;
+	prb->fastopen = parent->fastopen;
+#ifdef WITH_SSL
+	prb->ssl_ctx = parent->ssl_ctx;
+#endif /* WITH_SSL */
+	prb->owner = owner;
+	probe_setaddr(prb, af, address);
+	prb->resolved = 1;
 	return (prb);
 }
 
@@ -442,20 +1055,35 @@ void probe_free(struct probe *prb)
 	free(prb);
 }
 
+/*
+ * Latest resolution latency of the probe's hostname in microseconds,
+ * -1 if not resolved by name.
+ */
+long
+probe_latency(struct probe *prb)
+{
+
+	if (prb->dnstask == NULL)
+		return -1;
+	return dnstask_latency(prb->dnstask);
+}
+
 /*
  * Allocate session state for a single target probe and launch the probe.
+ * When both an IPv6 and IPv4 address is known they are raced, starting
+ * with the preferred family (RFC 8305).
  */
 void probe_send(struct probe *prb, int seq)
 {
 	struct session *session;
-	char buf[512];
-	int salen;
+	union addr *sa;
+	int n;
 
 	if (!prb->resolved) {
 		target_mark(prb->owner, seq, '@');
 		return;
 	}
-	session = calloc(1, sizeof(*session));
+	session = session_new();
 	if (session == NULL) {
 		target_mark(prb->owner, seq, '!');
 		return;
@@ -463,48 +1091,56 @@ void probe_send(struct probe *prb, int seq)
 	session->prb = prb;
 	session->seq = seq;
 	LL_APPEND(prb->sessions, session);
-#ifdef WITH_SSL
-	if (prb->ssl_ctx != NULL) {
-		session->ssl = SSL_new(prb->ssl_ctx);
-		if (session->ssl == NULL) {
-			target_mark(prb->owner, seq, '!');
-			session_free(session);
-			return;
-		}
-		session->bev = bufferevent_openssl_socket_new(ev_base, -1,
-		    session->ssl, BUFFEREVENT_SSL_CONNECTING,
-		    BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
-	} else {
-		session->bev = bufferevent_socket_new(ev_base, -1,
-		    BEV_OPT_CLOSE_ON_FREE);
+	session->dual = (prb->sa6.sa.sa_family == AF_INET6 &&
+	    prb->sa4.sa.sa_family == AF_INET);
+	session->racing = session->dual;
+	if (session->dual)
+		session->af = p_family;
+	else if (prb->sa6.sa.sa_family == AF_INET6)
+		session->af = AF_INET6;
+	else
+		session->af = AF_INET;
+	sa = probe_addr(prb, session->af);
+	n = session_connect(session, sa, &session->fd, &session->bev);
+	if (n < 0 && session->dual) {
+		/* failed right away, fall back to the other family */
+		session_close(session->fd, session->bev, 0);
+		session->fd = -1;
+		session->bev = NULL;
+		session->racing = 0;
+		session->af = OTHER_AF(session->af);
+		n = session_connect(session, probe_addr(prb, session->af),
+		    &session->fd, &session->bev);
 	}
-#else /* !WITH_SSL */
-	session->bev = bufferevent_socket_new(ev_base, -1,
-	    BEV_OPT_CLOSE_ON_FREE);
-#endif
-	if (session->bev == NULL) {
+	if (n < 0) {
 		target_mark(prb->owner, seq, '!');
 		session_free(session);
 		return;
 	}
-	bufferevent_setcb(session->bev, session_readcb_status, NULL,
-	    session_eventcb, session);
-	evutil_inet_ntop(AF_INET, &sin(prb)->sin_addr, buf, sizeof(buf));
-	bufferevent_enable(session->bev, EV_READ);
-	salen = sa(prb)->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
-	    sizeof(struct sockaddr_in);
-	if (bufferevent_socket_connect(session->bev, sa(prb), salen) < 0) {
-		target_mark(prb->owner, seq, '!');
-		return;
-	}
-	bufferevent_setwatermark(session->bev, EV_READ, 0, 4096);
+	if (session->racing)
+		event_add(session->ev_race, tv_race_common);
+	event_add(session->ev_timeout, tv_timeout_common);
+}
 
-	session->ev_timeout = event_new(ev_base, -1, 0, session_timeout,
-	    session);
-	if (session->ev_timeout == NULL) {
-		target_mark(prb->owner, seq, '!');
-		session_free(session);
-		return;
-	}
-	event_add(session->ev_timeout, &tv_timeout);
+/*
+ * Report socket state counters.
+ */
+void
+probe_stats(stats_cb_type cb, void *thunk)
+{
+
+	cb("sockets_open", sockstat.open, thunk);
+	cb("sockets_connecting", sockstat.open - sockstat.established, thunk);
+	cb("sockets_established", sockstat.established, thunk);
+	cb("sockets_opened", sockstat.opened, thunk);
+	cb("sockets_closed_fin", sockstat.closed_fin, thunk);
+	cb("sockets_closed_rst", sockstat.closed_rst, thunk);
+	cb("bind_errors", sockstat.bind_errors, thunk);
+	cb("port_retries", sockstat.port_retries, thunk);
+	cb("fastopen_syn_data", sockstat.fastopen_syn_data, thunk);
+	cb("fastopen_fallback", sockstat.fastopen_fallback, thunk);
+	if (P_lo > 0)
+		cb("source_ports", P_hi - P_lo + 1, thunk);
+	cb("race_won_ipv6", racestat.won_ipv6, thunk);
+	cb("race_won_ipv4", racestat.won_ipv4, thunk);
 }
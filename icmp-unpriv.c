@@ -20,6 +20,8 @@
 #include "xping.h"
 #include "tricks.h"
 
+extern int E_flag;
+
 struct probe {
 	char		host[MAXHOST];
 	int		resolved;
@@ -35,6 +37,8 @@ struct probe {
 	void		*owner;
 };
 
+const int probe_tcp = 0;
+
 static regex_t re_reply, re_other, re_xmiterr;
 
 static void
@@ -172,6 +176,17 @@ resolved(int af, void *address, void *thunk)
 	target_resolved(prb->owner, af, address);
 }
 
+/*
+ * Expanded hostname (-E), each address is probed as a target of its own.
+ */
+static void
+resolved_set(struct dnsset *set, void *thunk)
+{
+	struct probe *prb = thunk;
+
+	target_expand(prb->owner, set);
+}
+
 /*
  * Set up regular expressions for matching reply lines, unreachable lines,
  * and send errors.
@@ -256,7 +271,12 @@ probe_new(const char *line, void *owner)
 		}
 		prb->resolved = 1;
 	} else {
-		prb->dnstask = dnstask_new(prb->host, resolved, prb);
+		if (E_flag)
+			prb->dnstask = dnstask_new_set(prb->host,
+			    resolved_set, prb);
+		else
+			prb->dnstask = dnstask_new(prb->host, 0, resolved,
+			    prb);
 		if (prb->dnstask == NULL) {
 			probe_free(prb);
 			return NULL;
@@ -265,6 +285,19 @@ probe_new(const char *line, void *owner)
 	return (prb);
 }
 
+/*
+ * Probe for an address of an expanded hostname.
+ */
+struct probe *
+probe_new_sub(struct probe *parent, int af, void *address, void *owner)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (evutil_inet_ntop(af, address, buf, sizeof(buf)) == NULL)
+		return NULL;
+	return probe_new(buf, owner);
+}
+
 void probe_free(struct probe *prb)
 {
 
@@ -279,6 +312,19 @@ void probe_free(struct probe *prb)
 	free(prb);
 }
 
+/*
+ * Latest resolution latency of the probe's hostname in microseconds,
+ * -1 if not resolved by name.
+ */
+long
+probe_latency(struct probe *prb)
+{
+
+	if (prb->dnstask == NULL)
+		return -1;
+	return dnstask_latency(prb->dnstask);
+}
+
 void
 probe_send(struct probe *prb, int seq)
 {
@@ -340,3 +386,11 @@ probe_send(struct probe *prb, int seq)
 		break;
 	}
 }
+
+/*
+ * No module specific counters.
+ */
+void
+probe_stats(stats_cb_type cb, void *thunk)
+{
+}
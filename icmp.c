@@ -22,6 +22,8 @@
 #include <event2/event.h>
 #include "xping.h"
 
+extern int E_flag;
+
 #define ICMP6_MINLEN sizeof(struct icmp6_hdr)
 
 struct probe {
@@ -43,6 +45,8 @@ char	outpacket6[IP_MAXPACKET];
 int	datalen = 56;
 int	ident;
 
+const int probe_tcp = 0;
+
 /*
  * From the original ping.c by Mike Muus...
  *
@@ -118,8 +122,8 @@ deactivate(struct probe *prb)
 	struct probe *tmp, *tmp2, *t1;
 
 	HASH_FIND(hh, hash, &prb->sa, sizeof(union addr), tmp);
-	if (tmp == NULL)
-		return; /* already inactive, i.e. not in hash */
+	if (tmp != prb)
+		return; /* inactive or a duplicate, i.e. not in hash */
 	HASH_DELETE(hh, hash, prb);
 	t1 = NULL;
 	HASH_ITER(hh, hash, tmp, tmp2) {
@@ -372,6 +376,17 @@ resolved(int af, void *address, void *thunk)
 	target_resolved(prb->owner, af, address);
 }
 
+/*
+ * Expanded hostname (-E), each address is probed as a target of its own.
+ */
+static void
+resolved_set(struct dnsset *set, void *thunk)
+{
+	struct probe *prb = thunk;
+
+	target_expand(prb->owner, set);
+}
+
 /*
  * Prepare datastructures and events needed for probe
  */
@@ -449,7 +464,12 @@ probe_new(const char *line, void *owner)
 		prb->resolved = 1;
 		activate(prb);
 	} else {
-		prb->dnstask = dnstask_new(prb->host, resolved, prb);
+		if (E_flag)
+			prb->dnstask = dnstask_new_set(prb->host,
+			    resolved_set, prb);
+		else
+			prb->dnstask = dnstask_new(prb->host, 0, resolved,
+			    prb);
 		if (prb->dnstask == NULL) {
 			free(prb);
 			return NULL;
@@ -458,6 +478,19 @@ probe_new(const char *line, void *owner)
 	return (prb);
 }
 
+/*
+ * Probe for an address of an expanded hostname.
+ */
+struct probe *
+probe_new_sub(struct probe *parent, int af, void *address, void *owner)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (evutil_inet_ntop(af, address, buf, sizeof(buf)) == NULL)
+		return NULL;
+	return probe_new(buf, owner);
+}
+
 void
 probe_free(struct probe *prb)
 {
@@ -468,6 +501,19 @@ probe_free(struct probe *prb)
 	free(prb);
 }
 
+/*
+ * Latest resolution latency of the probe's hostname in microseconds,
+ * -1 if not resolved by name.
+ */
+long
+probe_latency(struct probe *prb)
+{
+
+	if (prb->dnstask == NULL)
+		return -1;
+	return dnstask_latency(prb->dnstask);
+}
+
 /*
  * Send out a single probe for a target.
  */
@@ -502,3 +548,11 @@ probe_send(struct probe *prb, int seq)
 		target_mark(prb->owner, seq, '$'); /* partial transmit */
 	}
 }
+
+/*
+ * No module specific counters.
+ */
+void
+probe_stats(stats_cb_type cb, void *thunk)
+{
+}
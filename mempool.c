@@ -0,0 +1,163 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "xping.h"
+
+/*
+ * Size class caching allocator for libevent. Bufferevents, evbuffer
+ * chains and their callbacks are allocated and released for every
+ * probe. Blocks up to MEMPOOL_MAXSIZE are rounded up to a power of two
+ * and kept on a free list per size class when released, so steady state
+ * probing is served without calling into the system allocator.
+ */
+#define MEMPOOL_MINSHIFT 5	/* 32 bytes */
+#define MEMPOOL_CLASSES 9	/* up to 8192 bytes */
+#define MEMPOOL_MAXSIZE (1 << (MEMPOOL_MINSHIFT + MEMPOOL_CLASSES - 1))
+
+/*
+ * Every block is prefixed by a header, two words keep the payload
+ * aligned as malloc would have.
+ */
+struct header {
+	size_t		size;
+	long		cls;
+};
+
+struct freeblock {
+	struct freeblock *next;
+};
+
+static struct freeblock *freelist[MEMPOOL_CLASSES];
+static unsigned long cached;
+static unsigned long hits;
+static unsigned long misses;
+
+/*
+ * Find size class for a given size or -1 if too large to be cached.
+ */
+static int
+sizeclass(size_t size)
+{
+	int cls;
+
+	if (size > MEMPOOL_MAXSIZE)
+		return -1;
+	for (cls = 0; ((size_t)1 << (cls + MEMPOOL_MINSHIFT)) < size; cls++)
+		;
+	return cls;
+}
+
+static void *
+mempool_malloc(size_t size)
+{
+	struct header *hdr;
+	struct freeblock *fb;
+	int cls;
+
+	cls = sizeclass(size);
+	if (cls >= 0 && freelist[cls] != NULL) {
+		fb = freelist[cls];
+		freelist[cls] = fb->next;
+		cached--;
+		hits++;
+		return fb;
+	}
+	if (cls >= 0)
+		size = (size_t)1 << (cls + MEMPOOL_MINSHIFT);
+	hdr = malloc(sizeof(*hdr) + size);
+	if (hdr == NULL)
+		return NULL;
+	hdr->size = size;
+	hdr->cls = cls;
+	misses++;
+	return hdr + 1;
+}
+
+static void
+mempool_free(void *ptr)
+{
+	struct header *hdr;
+	struct freeblock *fb;
+
+	if (ptr == NULL)
+		return;
+	hdr = (struct header *)ptr - 1;
+	if (hdr->cls < 0) {
+		free(hdr);
+		return;
+	}
+	fb = ptr;
+	fb->next = freelist[hdr->cls];
+	freelist[hdr->cls] = fb;
+	cached++;
+}
+
+static void *
+mempool_realloc(void *ptr, size_t size)
+{
+	struct header *hdr;
+	void *p;
+
+	if (ptr == NULL)
+		return mempool_malloc(size);
+	hdr = (struct header *)ptr - 1;
+	if (size <= hdr->size)
+		return ptr;
+	p = mempool_malloc(size);
+	if (p == NULL)
+		return NULL;
+	memcpy(p, ptr, hdr->size);
+	mempool_free(ptr);
+	return p;
+}
+
+/*
+ * Install the allocator, must be done before any other use of libevent.
+ */
+void
+mempool_setup(void)
+{
+
+	event_set_mem_functions(mempool_malloc, mempool_realloc,
+	    mempool_free);
+}
+
+/*
+ * Release cached blocks. Blocks still held by libevent are left alone.
+ */
+void
+mempool_cleanup(void)
+{
+	struct freeblock *fb;
+	int cls;
+
+	for (cls = 0; cls < MEMPOOL_CLASSES; cls++) {
+		while ((fb = freelist[cls]) != NULL) {
+			freelist[cls] = fb->next;
+			free((struct header *)fb - 1);
+		}
+	}
+	cached = 0;
+}
+
+void
+mempool_stats(stats_cb_type cb, void *thunk)
+{
+
+	cb("mempool_cached", cached, thunk);
+	cb("mempool_hits", hits, thunk);
+	cb("mempool_misses", misses, thunk);
+}
@@ -0,0 +1,402 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+
+#include "xping.h"
+
+/*
+ * Metrics exporter (-M), serving counters of every target in the
+ * Prometheus text format on GET /metrics from the event loop. A scrape
+ * is written a CHUNK targets at a time, the next chunk serialized as
+ * the client has taken the previous one, so a scrape of many targets
+ * is interleaved with probing instead of holding it up, and a slow
+ * client never holds more than about a chunk in memory.
+ */
+#define CHUNK		256		/* targets serialized at a time */
+#define LOWAT		(16 * 1024)	/* refill output below this */
+#define REQUEST_MAX	8192
+
+/* Quantiles of round trip times */
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+/* Upper bounds of round trip time buckets, microseconds */
+static const long bounds[RTT_BUCKETS] = {
+	500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000
+};
+
+static const struct {
+	const char	*name;
+	const char	*type;
+	const char	*help;
+} families[] = {
+	{ "xping_sent_total", "counter", "Probes sent." },
+	{ "xping_received_total", "counter", "Replies received in time." },
+	{ "xping_late_total", "counter", "Replies received late." },
+	{ "xping_unreachable_total", "counter",
+	    "Probes answered by unreachable." },
+	{ "xping_errors_total", "counter",
+	    "Probes not sent or otherwise failed." },
+	{ "xping_rtt_seconds", "histogram",
+	    "Round trip time of replies timed." },
+	{ "xping_loss_ratio", "gauge",
+	    "Probes without reply among the last in a window." },
+	{ "xping_rtt_quantile_seconds", "gauge",
+	    "Round trip time below which a quantile of them are." },
+};
+#define NFAMILIES (sizeof(families) / sizeof(families[0]))
+
+#define READING	0
+#define WRITING	1
+#define DONE	2
+
+struct scrape {
+	struct bufferevent	*bev;
+	int			state;
+	unsigned int		family;	/* being written */
+	struct target		*t;	/* next target of it */
+	struct scrape		*prev, *next;
+};
+
+static struct evconnlistener *listener;
+static struct scrape *scrapes;
+static unsigned long served;
+static unsigned long refused;
+
+static void
+scrape_free(struct scrape *sc)
+{
+
+	DL_DELETE(scrapes, sc);
+	bufferevent_free(sc->bev);
+	free(sc);
+}
+
+/*
+ * Add a target label, escaped as the format wants.
+ */
+static void
+addlabel(struct evbuffer *buf, const char *host)
+{
+	const char *p;
+
+	evbuffer_add(buf, "{target=\"", 9);
+	for (p = host; *p != '\0'; p++) {
+		if (*p == '\\' || *p == '"')
+			evbuffer_add_printf(buf, "\\%c", *p);
+		else if (*p == '\n')
+			evbuffer_add(buf, "\\n", 2);
+		else
+			evbuffer_add(buf, p, 1);
+	}
+	evbuffer_add(buf, "\"", 1);
+}
+
+static void
+addsample(struct evbuffer *buf, unsigned int family, struct target *t)
+{
+	const char *name = families[family].name;
+	unsigned long n = 0;
+	int i;
+
+	switch (family) {
+	case 0:
+		n = MAX(t->npkts - t->first, 0);
+		break;
+	case 1:
+		n = t->received;
+		break;
+	case 2:
+		n = t->late;
+		break;
+	case 3:
+		n = t->unreachable;
+		break;
+	case 4:
+		n = t->errors;
+		break;
+	case 5:
+		for (i = 0; i <= RTT_BUCKETS; i++) {
+			n += t->rtthist[i];
+			evbuffer_add_printf(buf, "%s_bucket", name);
+			addlabel(buf, t->host);
+			if (i < RTT_BUCKETS)
+				evbuffer_add_printf(buf, ",le=\"%g\"} %lu\n",
+				    bounds[i] / 1e6, n);
+			else
+				evbuffer_add_printf(buf, ",le=\"+Inf\"} %lu\n",
+				    n);
+		}
+		evbuffer_add_printf(buf, "%s_sum", name);
+		addlabel(buf, t->host);
+		evbuffer_add_printf(buf, "} %.6f\n", t->rttsum / 1e6);
+		evbuffer_add_printf(buf, "%s_count", name);
+		addlabel(buf, t->host);
+		evbuffer_add_printf(buf, "} %lu\n", n);
+		return;
+	case 6:
+		for (i = 0; i < LOSS_WINDOWS; i++) {
+			if (window_probes(t, i) == 0)
+				continue;
+			evbuffer_add_printf(buf, "%s", name);
+			addlabel(buf, t->host);
+			evbuffer_add_printf(buf, ",window=\"%d\"} %g\n",
+			    window_size[i],
+			    (double)t->window[i] / window_probes(t, i));
+		}
+		return;
+	case 7:
+		for (i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0]))
+		    && t->rttsketch.count > 0; i++) {
+			evbuffer_add_printf(buf, "%s", name);
+			addlabel(buf, t->host);
+			evbuffer_add_printf(buf, ",quantile=\"%g\"} %.6f\n",
+			    quantiles[i],
+			    sketch_quantile(&t->rttsketch, quantiles[i]) / 1e6);
+		}
+		return;
+	}
+	evbuffer_add_printf(buf, "%s", name);
+	addlabel(buf, t->host);
+	evbuffer_add_printf(buf, "} %lu\n", n);
+}
+
+/*
+ * Counters of the program itself, as given by the modules.
+ */
+static void
+addstat(const char *name, unsigned long value, void *thunk)
+{
+	struct evbuffer *buf = thunk;
+
+	evbuffer_add_printf(buf, "# TYPE xping_%s untyped\nxping_%s %lu\n",
+	    name, name, value);
+}
+
+/*
+ * Serialize the next chunk of a scrape, or finish it.
+ */
+static void
+fill(struct scrape *sc)
+{
+	struct evbuffer *buf = bufferevent_get_output(sc->bev);
+	int n = 0;
+
+	while (sc->family < NFAMILIES && n < CHUNK) {
+		if (sc->t == list)
+			evbuffer_add_printf(buf, "# HELP %s %s\n# TYPE %s %s\n",
+			    families[sc->family].name,
+			    families[sc->family].help,
+			    families[sc->family].name,
+			    families[sc->family].type);
+		for (; sc->t != NULL && n < CHUNK; sc->t = sc->t->next) {
+			if (sc->t->expanded)
+				continue; /* not probed, its addresses are */
+			addsample(buf, sc->family, sc->t);
+			n++;
+		}
+		if (sc->t == NULL) {
+			sc->family++;
+			sc->t = list;
+		}
+	}
+	if (sc->family < NFAMILIES)
+		return;
+	evbuffer_add_printf(buf, "# TYPE xping_targets gauge\n"
+	    "xping_targets %d\n", numtargets);
+	stats_walk(addstat, buf);
+	sc->state = DONE;
+	served++;
+}
+
+static void
+writecb(struct bufferevent *bev, void *thunk)
+{
+	struct scrape *sc = thunk;
+
+	if (sc->state == WRITING)
+		fill(sc);
+	else if (sc->state == DONE &&
+	    evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+		scrape_free(sc);
+}
+
+static void
+readcb(struct bufferevent *bev, void *thunk)
+{
+	struct scrape *sc = thunk;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	struct evbuffer *out = bufferevent_get_output(bev);
+	struct evbuffer_ptr end;
+	const char *req;
+	size_t n;
+
+	end = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+	if (end.pos < 0) {
+		if (evbuffer_get_length(in) > REQUEST_MAX)
+			scrape_free(sc);
+		return;
+	}
+	bufferevent_disable(bev, EV_READ);
+	n = end.pos + 2;
+	req = (const char *)evbuffer_pullup(in, n);
+	if (n > 13 && strncmp(req, "GET /metrics", 12) == 0 &&
+	    strchr(" ?\r", req[12]) != NULL) {
+		evbuffer_add_printf(out, "HTTP/1.0 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Connection: close\r\n\r\n");
+		sc->state = WRITING;
+		sc->family = 0;
+		sc->t = list;
+		fill(sc);
+	} else {
+		evbuffer_add_printf(out, "HTTP/1.0 404 Not Found\r\n"
+		    "Connection: close\r\n\r\n");
+		sc->state = DONE;
+		refused++;
+	}
+	evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+static void
+eventcb(struct bufferevent *bev, short what, void *thunk)
+{
+
+	if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		scrape_free(thunk);
+}
+
+static void
+accepted(struct evconnlistener *l, evutil_socket_t fd, struct sockaddr *sa,
+    int salen, void *thunk)
+{
+	struct scrape *sc;
+
+	sc = calloc(1, sizeof(*sc));
+	if (sc == NULL) {
+		evutil_closesocket(fd);
+		return;
+	}
+	sc->bev = bufferevent_socket_new(ev_base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (sc->bev == NULL) {
+		evutil_closesocket(fd);
+		free(sc);
+		return;
+	}
+	bufferevent_setcb(sc->bev, readcb, writecb, eventcb, sc);
+	bufferevent_setwatermark(sc->bev, EV_WRITE, LOWAT, 0);
+	bufferevent_enable(sc->bev, EV_READ | EV_WRITE);
+	DL_APPEND(scrapes, sc);
+}
+
+/*
+ * Listen for scrapes on an address and port, or a port alone on the
+ * loopback address.
+ */
+int
+metrics_init(const char *addr)
+{
+	union addr sa;
+	char buf[64];
+	int salen = sizeof(sa);
+
+	if (strspn(addr, "0123456789") == strlen(addr)) {
+		snprintf(buf, sizeof(buf), "127.0.0.1:%s", addr);
+		addr = buf;
+	}
+	memset(&sa, 0, sizeof(sa));
+	if (evutil_parse_sockaddr_port(addr, &sa.sa, &salen) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	listener = evconnlistener_new_bind(ev_base, accepted, NULL,
+	    LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 16, &sa.sa, salen);
+	return (listener != NULL ? 0 : -1);
+}
+
+/*
+ * A result was marked, count it. Counted without the exporter too, the
+ * status board (-S) publishes the counters.
+ */
+void
+metrics_result(struct target *t, int seq, long rtt)
+{
+	int i;
+
+	switch (t->res[seq % NUM]) {
+	case '.':
+		t->received++;
+		if (rtt < 0)
+			break;
+		for (i = 0; i < RTT_BUCKETS && rtt > bounds[i]; i++)
+			;
+		t->rtthist[i]++;
+		t->rttsum += rtt;
+		break;
+	case ':':
+		t->late++;
+		break;
+	case '#':
+		t->unreachable++;
+		break;
+	case '?':
+	case ' ':
+		break;
+	default:
+		t->errors++;
+		break;
+	}
+}
+
+/*
+ * A target is going away, move scrapes about to write it past it.
+ */
+void
+metrics_remove(struct target *t)
+{
+	struct scrape *sc;
+
+	DL_FOREACH(scrapes, sc)
+		if (sc->t == t)
+			sc->t = t->next;
+}
+
+void
+metrics_stats(stats_cb_type cb, void *thunk)
+{
+
+	if (listener == NULL)
+		return;
+	cb("metrics_scrapes", served, thunk);
+	cb("metrics_refused", refused, thunk);
+}
+
+void
+metrics_cleanup(void)
+{
+	struct scrape *sc, *tmp;
+
+	DL_FOREACH_SAFE(scrapes, sc, tmp)
+		scrape_free(sc);
+	if (listener != NULL)
+		evconnlistener_free(listener);
+	listener = NULL;
+}
@@ -0,0 +1,314 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#define _GNU_SOURCE	/* sendmmsg() */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "xping.h"
+
+/*
+ * Push of metrics (-G) over UDP in the StatsD or Graphite line format,
+ * every interval (-g) apart from probing. Each target gives probes sent
+ * and replies received since the last push, the loss among them and
+ * their average round trip time, and the 99th percentile of all round
+ * trip times so far. Lines are packed into datagrams of at most
+ * PUSH_MTU bytes, a line never split, and up to PUSH_BATCH of them are
+ * sent with a single sendmmsg() where there is one. When the socket
+ * buffer is full the push resumes as it is writable, from the target
+ * where it was, so a push of many targets never holds up probing. A
+ * push still going when the next is due makes that one skipped.
+ */
+#define PUSH_MTU	1432	/* fits the path MTU of most networks */
+#define PUSH_BATCH	64	/* datagrams sent at a time */
+#define PUSH_PREFIX	"xping"
+
+#define STATSD		0
+#define GRAPHITE	1
+
+static int fd = -1;
+static int format;
+static struct event *ev_flush;
+static struct event *ev_write;
+static struct target *cursor;	/* next target of a push going on */
+static int pushing;
+static long stamp;		/* time of the push, Graphite */
+
+static char dgrams[PUSH_BATCH][PUSH_MTU];
+static size_t lens[PUSH_BATCH];
+static int ndgrams;		/* filled, the last one maybe partly */
+static int nsent;		/* of those, sent */
+
+static unsigned long pushes;
+static unsigned long skipped;
+static unsigned long datagrams;
+static unsigned long dropped;
+
+/*
+ * Send the datagrams filled, returns -1 when the socket buffer is full.
+ */
+static int
+send_batch(void)
+{
+#ifdef __linux__
+	struct mmsghdr msgs[PUSH_BATCH];
+#else
+	struct msghdr msg;
+#endif
+	struct iovec iov[PUSH_BATCH];
+	int i, n;
+
+	for (i = nsent; i < ndgrams; i++) {
+		iov[i].iov_base = dgrams[i];
+		iov[i].iov_len = lens[i];
+	}
+	while (nsent < ndgrams) {
+#ifdef __linux__
+		memset(msgs, 0, sizeof(msgs));
+		for (i = nsent; i < ndgrams; i++) {
+			msgs[i - nsent].msg_hdr.msg_iov = &iov[i];
+			msgs[i - nsent].msg_hdr.msg_iovlen = 1;
+		}
+		n = sendmmsg(fd, msgs, ndgrams - nsent, 0);
+#else
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov[nsent];
+		msg.msg_iovlen = 1;
+		n = (sendmsg(fd, &msg, 0) < 0 ? -1 : 1);
+#endif
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return -1;
+		if (n < 0) {
+			/* e.g. refused by an earlier ICMP unreachable */
+			dropped += ndgrams - nsent;
+			break;
+		}
+		nsent += n;
+		datagrams += n;
+	}
+	ndgrams = nsent = 0;
+	return 0;
+}
+
+/*
+ * Add a line, starting a new datagram if it doesn't fit.
+ */
+static void
+addline(const char *line, size_t len)
+{
+
+	if (ndgrams > 0 && lens[ndgrams - 1] + len <= PUSH_MTU) {
+		memcpy(dgrams[ndgrams - 1] + lens[ndgrams - 1], line, len);
+		lens[ndgrams - 1] += len;
+		return;
+	}
+	memcpy(dgrams[ndgrams], line, len);
+	lens[ndgrams++] = len;
+}
+
+static void
+addmetric(const char *name, const char *metric, double value,
+    const char *type)
+{
+	char line[PUSH_MTU];
+	int len;
+
+	if (format == GRAPHITE)
+		len = snprintf(line, sizeof(line), "%s.%s.%s %g %ld\n",
+		    PUSH_PREFIX, name, metric, value, stamp);
+	else
+		len = snprintf(line, sizeof(line), "%s.%s.%s:%g|%s\n",
+		    PUSH_PREFIX, name, metric, value, type);
+	if (len > 0 && len < (int)sizeof(line))
+		addline(line, len);
+}
+
+/*
+ * Add the lines of a target, what changed since the last push. Loss is
+ * of the probes settled since, as drawn, the probe in flight is left
+ * for the next push.
+ */
+static void
+addtarget(struct target *t)
+{
+	char name[MAXHOST];
+	unsigned long rtts = 0, sent, received;
+	int i, settled, lost = 0;
+
+	for (i = 0; t->host[i] != '\0' && i < (int)sizeof(name) - 1; i++)
+		name[i] = (isalnum((unsigned char)t->host[i]) ||
+		    t->host[i] == '-') ? t->host[i] : '_';
+	name[i] = '\0';
+	for (i = 0; i <= RTT_BUCKETS; i++)
+		rtts += t->rtthist[i];
+
+	sent = MAX(t->npkts - t->first, 0) - t->pushed.sent;
+	received = t->received - t->pushed.received;
+	addmetric(name, "sent", sent, "c");
+	addmetric(name, "received", received, "c");
+	settled = MAX(t->pushed.settled, MAX(t->npkts - 1 - NUM, t->first));
+	for (i = settled; i < t->npkts - 1; i++)
+		if (t->res[i % NUM] != '.')
+			lost++;
+	if (i > settled)
+		addmetric(name, "loss", 100.0 * lost / (i - settled), "g");
+	if (rtts > t->pushed.rtts)
+		addmetric(name, "rtt", (t->rttsum - t->pushed.rttsum) /
+		    (rtts - t->pushed.rtts) / 1000.0, "g");
+	if (t->rttsketch.count > 0)
+		addmetric(name, "rtt_p99",
+		    sketch_quantile(&t->rttsketch, 0.99) / 1000.0, "g");
+
+	t->pushed.settled = MAX(i, settled);
+	t->pushed.sent += sent;
+	t->pushed.received = t->received;
+	t->pushed.rtts = rtts;
+	t->pushed.rttsum = t->rttsum;
+}
+
+/*
+ * Go on with the push, a batch of datagrams at a time.
+ */
+static void
+resume(void)
+{
+
+	for (;;) {
+		if (send_batch() < 0) {
+			event_add(ev_write, NULL);
+			return;
+		}
+		if (cursor == NULL)
+			break;
+		/* stop short of a full batch, a target adds a few lines */
+		while (cursor != NULL && ndgrams < PUSH_BATCH - 1) {
+			if (!cursor->expanded)
+				addtarget(cursor);
+			cursor = cursor->next;
+		}
+	}
+	pushing = 0;
+}
+
+static void
+writable(int fd, short what, void *thunk)
+{
+
+	resume();
+}
+
+static void
+flush(int fd, short what, void *thunk)
+{
+	struct timeval now;
+
+	if (pushing) {
+		skipped++;
+		return;
+	}
+	evutil_gettimeofday(&now, NULL);
+	stamp = now.tv_sec;
+	pushes++;
+	pushing = 1;
+	cursor = list;
+	resume();
+}
+
+/*
+ * Push to a StatsD or Graphite address and port, a port alone on the
+ * loopback address, every interval milliseconds.
+ */
+int
+push_init(const char *dest, int interval)
+{
+	union addr sa;
+	struct timeval tv;
+	char buf[64];
+	int salen = sizeof(sa);
+
+	if (strncmp(dest, "graphite:", 9) == 0) {
+		format = GRAPHITE;
+		dest += 9;
+	} else if (strncmp(dest, "statsd:", 7) == 0) {
+		format = STATSD;
+		dest += 7;
+	}
+	if (strspn(dest, "0123456789") == strlen(dest)) {
+		snprintf(buf, sizeof(buf), "127.0.0.1:%s", dest);
+		dest = buf;
+	}
+	memset(&sa, 0, sizeof(sa));
+	if (evutil_parse_sockaddr_port(dest, &sa.sa, &salen) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	fd = socket(sa.sa.sa_family, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	if (evutil_make_socket_nonblocking(fd) < 0 ||
+	    connect(fd, &sa.sa, salen) < 0) {
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+	ev_write = event_new(ev_base, fd, EV_WRITE, writable, NULL);
+	ev_flush = event_new(ev_base, -1, EV_PERSIST, flush, NULL);
+	tv.tv_sec = interval / 1000;
+	tv.tv_usec = interval % 1000 * 1000;
+	event_add(ev_flush, &tv);
+	return 0;
+}
+
+/*
+ * A target is going away, move a push about to add it past it.
+ */
+void
+push_remove(struct target *t)
+{
+
+	if (cursor == t)
+		cursor = t->next;
+}
+
+void
+push_stats(stats_cb_type cb, void *thunk)
+{
+
+	if (fd < 0)
+		return;
+	cb("push_flushes", pushes, thunk);
+	cb("push_skipped", skipped, thunk);
+	cb("push_datagrams", datagrams, thunk);
+	cb("push_dropped", dropped, thunk);
+}
+
+void
+push_cleanup(void)
+{
+
+	if (fd < 0)
+		return;
+	event_free(ev_flush);
+	event_free(ev_write);
+	close(fd);
+	fd = -1;
+}
@@ -0,0 +1,239 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdlib.h>
+
+#include "xping.h"
+
+/*
+ * Ranking of targets for the worst offenders view. All targets are
+ * kept in a binary heap, worst on top, by recent loss or round trip
+ * time. Each target knows its index in the heap, so a target whose
+ * results change is moved in O(log n) and the worst k are found
+ * without sorting all targets.
+ */
+
+static struct target **heap;
+static int heapsize;
+static int heapcap;
+static int mode = RANK_LOSS;
+
+/*
+ * Recent loss, the number of probes without reply among the last
+ * LOSS_WINDOW as counted by window.c. Hostnames expanded by address are
+ * never worst.
+ */
+static int
+recentloss(struct target *t)
+{
+
+	if (t->expanded)
+		return 0;
+	return t->window[WINDOW_RANK];
+}
+
+/*
+ * Does target a rank worse than b, by the current mode with the other
+ * measure to break ties.
+ */
+static int
+worse(struct target *a, struct target *b)
+{
+
+	if (mode == RANK_RTT && a->srtt != b->srtt)
+		return a->srtt > b->srtt;
+	if (a->loss != b->loss)
+		return a->loss > b->loss;
+	return a->srtt > b->srtt;
+}
+
+static void
+place(int i, struct target *t)
+{
+
+	heap[i] = t;
+	t->rankidx = i;
+}
+
+static void
+siftup(int i)
+{
+	struct target *t = heap[i];
+
+	while (i > 0 && worse(t, heap[(i - 1) / 2])) {
+		place(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	place(i, t);
+}
+
+static void
+siftdown(int i)
+{
+	struct target *t = heap[i];
+	int c;
+
+	while ((c = 2 * i + 1) < heapsize) {
+		if (c + 1 < heapsize && worse(heap[c + 1], heap[c]))
+			c++;
+		if (!worse(heap[c], t))
+			break;
+		place(i, heap[c]);
+		i = c;
+	}
+	place(i, t);
+}
+
+int
+rank_add(struct target *t)
+{
+	struct target **h;
+	int cap;
+
+	if (heapsize == heapcap) {
+		cap = MAX(heapcap * 2, 64);
+		h = realloc(heap, cap * sizeof(*h));
+		if (h == NULL)
+			return -1;
+		heap = h;
+		heapcap = cap;
+	}
+	t->loss = recentloss(t);
+	place(heapsize++, t);
+	siftup(t->rankidx);
+	return 0;
+}
+
+void
+rank_remove(struct target *t)
+{
+	int i = t->rankidx;
+
+	if (i < 0 || i >= heapsize || heap[i] != t)
+		return;
+	t->rankidx = -1;
+	if (i == --heapsize)
+		return;
+	place(i, heap[heapsize]);
+	siftup(i);
+	siftdown(heap[i]->rankidx);
+}
+
+/*
+ * Results of a target changed, move it in the heap.
+ */
+void
+rank_update(struct target *t)
+{
+	int i = t->rankidx;
+
+	if (i < 0 || i >= heapsize || heap[i] != t)
+		return;
+	t->loss = recentloss(t);
+	siftup(i);
+	siftdown(t->rankidx);
+}
+
+/*
+ * Change what to rank by, and rebuild the heap.
+ */
+void
+rank_mode(int m)
+{
+	int i;
+
+	mode = m;
+	for (i = heapsize / 2 - 1; i >= 0; i--)
+		siftdown(i);
+}
+
+/*
+ * Candidates while searching for the worst targets, heap indices kept
+ * in a small heap of their own.
+ */
+static int *cand;
+static int ncand;
+static int candcap;
+
+static void
+candpush(int x)
+{
+	int i = ncand++;
+
+	while (i > 0 && worse(heap[x], heap[cand[(i - 1) / 2]])) {
+		cand[i] = cand[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	cand[i] = x;
+}
+
+static int
+candpop(void)
+{
+	int x = cand[0];
+	int last = cand[--ncand];
+	int i = 0, c;
+
+	while ((c = 2 * i + 1) < ncand) {
+		if (c + 1 < ncand && worse(heap[cand[c + 1]], heap[cand[c]]))
+			c++;
+		if (!worse(heap[cand[c]], heap[last]))
+			break;
+		cand[i] = cand[c];
+		i = c;
+	}
+	cand[i] = last;
+	return x;
+}
+
+/*
+ * Find the k worst targets, worst first. The heap is searched best
+ * first from the top, as only children of a target taken can be next,
+ * in O(k log k). Returns the number found.
+ */
+int
+rank_top(struct target **out, int k)
+{
+	int *c;
+	int n = 0;
+	int x;
+
+	if (candcap < k + 2) {
+		c = realloc(cand, (k + 2) * sizeof(*c));
+		if (c == NULL)
+			return 0;
+		cand = c;
+		candcap = k + 2;
+	}
+	ncand = 0;
+	if (heapsize > 0)
+		candpush(0);
+	while (n < k && ncand > 0) {
+		x = candpop();
+		out[n++] = heap[x];
+		if (2 * x + 1 < heapsize)
+			candpush(2 * x + 1);
+		if (2 * x + 2 < heapsize)
+			candpush(2 * x + 2);
+	}
+	return n;
+}
+
+void
+rank_cleanup(void)
+{
+
+	free(heap);
+	free(cand);
+	heap = NULL;
+	cand = NULL;
+	heapsize = heapcap = candcap = 0;
+}
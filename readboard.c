@@ -0,0 +1,155 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "xpingboard.h"
+
+extern char *optarg;
+extern int optind;
+
+/*
+ * Reader of the status board (-S) of a running xping, writing a line
+ * per target with its counters and most recent results. An example of
+ * reading the board as well, through xpingboard.h alone.
+ */
+int	n_results = 40;
+int	i_interval = 0;
+int	w_width = 20;
+
+static void
+usage(const char *whine)
+{
+	if (whine != NULL) {
+		fprintf(stderr, "%s\n", whine);
+	}
+	fprintf(stderr,
+	    "usage: xping-board [-i interval] [-n results] [-w width] board\n"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+static void
+print_rtt(long long rtt)
+{
+
+	if (rtt >= 0)
+		printf(" %8.1f", rtt / 1000.0);
+	else
+		printf(" %8s", "-");
+}
+
+/*
+ * Write the targets of the board, returns -1 if it isn't a board.
+ */
+static int
+show(const struct xpb_header *h, size_t size)
+{
+	struct xpb_target rec;
+	uint32_t i, used;
+	int n, j;
+
+	if (size < sizeof(*h) || memcmp(h->magic, XPB_MAGIC, 8) != 0 ||
+	    h->version != XPB_VERSION || h->recsize < sizeof(rec) ||
+	    h->hdrsize + (size_t)h->capacity * h->recsize > size)
+		return -1;
+	used = MIN(__atomic_load_n(&h->used, __ATOMIC_ACQUIRE), h->capacity);
+	printf("%*s %8s %8s %6s %6s %6s %8s %8s  results\n", w_width, "target",
+	    "sent", "received", "late", "unrch", "errors", "rtt", "srtt");
+	for (i = 0; i < used; i++) {
+		if (xpb_read(xpb_record(h, i), &rec) < 0 ||
+		    !(rec.flags & XPB_USED))
+			continue;
+		printf("%*.*s %8d %8llu %6llu %6llu %6llu", w_width, w_width,
+		    rec.host, MAX(rec.npkts - rec.first, 0),
+		    (unsigned long long)rec.received,
+		    (unsigned long long)rec.late,
+		    (unsigned long long)rec.unreachable,
+		    (unsigned long long)rec.errors);
+		print_rtt(rec.rtt);
+		print_rtt(rec.srtt);
+		printf("  ");
+		n = MIN(n_results, MIN(rec.npkts - rec.first, XPB_WINDOW));
+		for (j = rec.npkts - n; j < rec.npkts; j++)
+			putchar(rec.res[j % XPB_WINDOW]);
+		putchar('\n');
+	}
+	if (h->pid == 0)
+		printf("(xping has exited)\n");
+	fflush(stdout);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stat sb;
+	void *map;
+	char *end;
+	int ch, fd;
+
+	while ((ch = getopt(argc, argv, "hi:n:w:")) != -1) {
+		switch(ch) {
+		case 'i':
+			i_interval = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || i_interval < 0)
+				usage("Invalid interval");
+			break;
+		case 'n':
+			n_results = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || n_results < 0)
+				usage("Invalid number of results");
+			break;
+		case 'w':
+			w_width = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || w_width < 0)
+				usage("Invalid width");
+			break;
+		default:
+			usage(NULL);
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage(NULL);
+
+	if ((fd = open(argv[0], O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		perror(argv[0]);
+		return 1;
+	}
+	map = mmap(NULL, MAX(sb.st_size, 1), PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(argv[0]);
+		return 1;
+	}
+	close(fd);
+	for (;;) {
+		if (show(map, sb.st_size) < 0) {
+			fprintf(stderr, "%s: not an xping board\n", argv[0]);
+			return 1;
+		}
+		if (i_interval == 0)
+			break;
+		sleep(i_interval);
+		printf("\n");
+	}
+	munmap(map, MAX(sb.st_size, 1));
+	return 0;
+}
@@ -0,0 +1,392 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "xping.h"
+
+extern char *optarg;
+extern int optind;
+
+/*
+ * Replay of a binary log (-L) through the terminal or report output of
+ * xping, at the pace results were logged or faster. The log is mapped
+ * and read in place, records are applied to targets much as xping
+ * marks them. Starting later in the log seeks to the checkpoint before,
+ * and results up to the start are applied without being shown.
+ */
+#define BATCH	4096	/* records applied between loop turns */
+
+/* Option flags, as of xping */
+int	B_flag = 0;
+int	C_flag = 0;
+int	J_flag = 0;
+int	w_width = 20;
+double	s_speed = 1.0;
+double	t_skip = 0;
+
+/* Global structures */
+struct	event_base *ev_base;
+struct	target *list = NULL;
+int	numtargets = 0;
+int	i_interval = 1000;
+int	fd4 = -1, fd4errno;
+int	fd6 = -1, fd6errno;
+
+void (*ui_init)(void) = termio_init;
+void (*ui_update)(struct target *) = termio_update;
+void (*ui_cleanup)(void) = termio_cleanup;
+
+static struct binlog_reader reader;
+static struct binlog_record rec;
+static int pending;		/* rec read and not yet applied */
+static struct target **table;	/* targets by log number */
+static unsigned int ntable;
+static uint64_t log_start;	/* time replay started, in the log */
+static struct timeval wall_start;
+static struct timeval tv_rec;	/* time of the record applied */
+static struct event *ev_step;
+static int invalid;
+
+static struct target *
+target_new(unsigned int idx)
+{
+	struct target *t, **p;
+	unsigned int n;
+
+	if (idx >= ntable) {
+		n = MAX(idx + 1, 2 * ntable);
+		p = realloc(table, n * sizeof(*table));
+		if (p == NULL)
+			return NULL;
+		memset(p + ntable, 0, (n - ntable) * sizeof(*table));
+		table = p;
+		ntable = n;
+	}
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	memset(t->res, ' ', sizeof(t->res));
+	t->srtt = -1;
+	t->first = -1;
+	DL_APPEND(list, t);
+	rank_add(t);
+	numtargets++;
+	table[idx] = t;
+	return t;
+}
+
+static void
+target_free(struct target *t)
+{
+
+	rank_remove(t);
+	subnet_remove(t);
+	DL_DELETE(list, t);
+	numtargets--;
+	free(t);
+}
+
+/*
+ * Name a target, indexed by address when named by one.
+ */
+static void
+apply_target(void)
+{
+	struct target *t;
+	struct in6_addr addr6;
+	struct in_addr addr4;
+
+	t = (rec.idx < ntable ? table[rec.idx] : NULL);
+	if (t == NULL && (t = target_new(rec.idx)) == NULL)
+		return;
+	t->host[0] = '\0';
+	strncat(t->host, rec.name, MIN(rec.namelen, sizeof(t->host) - 1));
+	if (t->subnet != NULL || t->expanded)
+		return;
+	if (evutil_inet_pton(AF_INET6, t->host, &addr6) == 1) {
+		t->af = t->addr.sa.sa_family = AF_INET6;
+		memcpy(&t->addr.sin6.sin6_addr, &addr6, sizeof(addr6));
+	} else if (evutil_inet_pton(AF_INET, t->host, &addr4) == 1) {
+		t->af = t->addr.sa.sa_family = AF_INET;
+		memcpy(&t->addr.sin.sin_addr, &addr4, sizeof(addr4));
+	}
+	subnet_add(t);
+}
+
+/*
+ * Mark a result, the probes between the last one and it as sent.
+ */
+static struct target *
+apply_result(void)
+{
+	struct target *t;
+	int old;
+
+	t = (rec.idx < ntable ? table[rec.idx] : NULL);
+	if (t == NULL || rec.seq < t->npkts - NUM)
+		return NULL;
+	if (t->first < 0)
+		t->first = t->npkts = rec.seq;
+	if (rec.seq >= t->npkts + NUM) {
+		/* none of the results kept are left */
+		memset(t->res, ' ', NUM);
+		t->npkts = rec.seq + 1 - NUM;
+		window_reset(t);
+	}
+	for (; t->npkts <= rec.seq; t->npkts++) {
+		window_probe(t);
+		t->res[t->npkts % NUM] = ' ';
+	}
+	old = t->res[rec.seq % NUM];
+	t->res[rec.seq % NUM] = rec.symbol;
+	window_mark(t, rec.seq, old);
+	if (rec.symbol == '@' || (rec.symbol == ' ' && !t->expanded)) {
+		/* an expanded hostname, keeping time */
+		t->expanded = 1;
+		subnet_remove(t);
+	}
+	if (rec.rtt >= 0) {
+		t->srtt = (t->srtt < 0) ? rec.rtt :
+		    t->srtt + (rec.rtt - t->srtt) / 8;
+		sketch_add(&t->rttsketch, rec.rtt);
+		subnet_rtt(t, rec.rtt);
+	}
+	rank_update(t);
+	subnet_update(t);
+	return t;
+}
+
+/*
+ * Apply a record, showing it unless seeking.
+ */
+static void
+apply(int show)
+{
+	struct target *t;
+
+	tv_rec.tv_sec = rec.time / 1000000;
+	tv_rec.tv_usec = rec.time % 1000000;
+	switch (rec.type) {
+	case BINLOG_TARGET:
+		apply_target();
+		break;
+	case BINLOG_REMOVE:
+		if (rec.idx < ntable && table[rec.idx] != NULL) {
+			target_free(table[rec.idx]);
+			table[rec.idx] = NULL;
+		}
+		break;
+	case BINLOG_RESULT:
+		t = apply_result();
+		if (t == NULL || !show)
+			return;
+		if (J_flag)
+			report_result(t, rec.seq, rec.rtt);
+		ui_update(t);
+		return;
+	}
+	if (show)
+		ui_update(NULL);
+}
+
+static int
+next(void)
+{
+	int n;
+
+	if (pending)
+		return 1;
+	n = binlog_read(&reader, &rec);
+	if (n < 0)
+		invalid = 1;
+	pending = (n > 0);
+	return pending;
+}
+
+/*
+ * Apply the records due, by the time passed since the start and the
+ * speed, and wait for the next one.
+ */
+static void
+step(int fd, short what, void *thunk)
+{
+	struct timeval now, tv;
+	uint64_t due, elapsed;
+	int n;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &wall_start, &tv);
+	elapsed = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	for (n = 0; n < BATCH && next(); n++) {
+		if (s_speed > 0) {
+			due = (rec.time - log_start) / s_speed;
+			if (rec.time > log_start && due > elapsed) {
+				tv.tv_sec = (due - elapsed) / 1000000;
+				tv.tv_usec = (due - elapsed) % 1000000;
+				event_add(ev_step, &tv);
+				return;
+			}
+		}
+		apply(1);
+		pending = 0;
+	}
+	if (pending || next()) {
+		tv.tv_sec = tv.tv_usec = 0;
+		event_add(ev_step, &tv);
+	} else {
+		event_base_loopexit(ev_base, NULL);
+	}
+}
+
+static void
+sigint(int sig)
+{
+
+	event_base_loopexit(ev_base, NULL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+}
+
+static void
+usage(const char *whine)
+{
+	if (whine != NULL) {
+		fprintf(stderr, "%s\n", whine);
+	}
+	fprintf(stderr,
+	    "usage: xping-replay [-BCJV] [-s speed] [-t skip] [-w width] "
+	    "logfile\n"
+	    "\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct target *t, *t_tmp;
+	struct stat sb;
+	struct timeval tv;
+	void *map;
+	char *end;
+	int ch, fd;
+
+	while ((ch = getopt(argc, argv, "BCJVhs:t:w:")) != -1) {
+		switch(ch) {
+		case 'B':
+			B_flag = 1;
+			break;
+		case 'C':
+			C_flag = 1;
+			break;
+		case 'J':
+			J_flag = 1;
+			break;
+		case 's':
+			s_speed = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' || s_speed < 0)
+				usage("Invalid speed");
+			break;
+		case 't':
+			t_skip = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' || t_skip < 0)
+				usage("Invalid skip");
+			break;
+		case 'w':
+			w_width = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || w_width < 0)
+				usage("Invalid width");
+			break;
+		case 'V':
+			fprintf(stderr, "%s %s\n", "xping-replay", version);
+			return (0);
+		default:
+			usage(NULL);
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage(NULL);
+
+	if ((fd = open(argv[0], O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		perror(argv[0]);
+		return 1;
+	}
+	map = mmap(NULL, MAX(sb.st_size, 1), PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(argv[0]);
+		return 1;
+	}
+	close(fd);
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+	if (binlog_reader(&reader, map, sb.st_size) < 0) {
+		fprintf(stderr, "%s: not an xping log\n", argv[0]);
+		return 1;
+	}
+
+	/* Seek, applying results up to the start without showing them */
+	if (next()) {
+		log_start = rec.time + t_skip * 1000000;
+		if (t_skip > 0) {
+			binlog_seek(&reader, log_start);
+			pending = 0;
+		}
+		while (next() && rec.time < log_start) {
+			apply(0);
+			pending = 0;
+		}
+	}
+
+	ev_base = event_base_new();
+	if (!isatty(STDOUT_FILENO) || J_flag) {
+		ui_init = report_init;
+		ui_update = report_update;
+		ui_cleanup = report_cleanup;
+	}
+	report_clock(&tv_rec);
+	signal(SIGINT, sigint);
+	signal(SIGTERM, sigint);
+	ev_step = event_new(ev_base, -1, 0, step, NULL);
+	evutil_gettimeofday(&wall_start, NULL);
+	tv.tv_sec = tv.tv_usec = 0;
+	event_add(ev_step, &tv);
+	ui_init();
+	event_base_dispatch(ev_base);
+	ui_cleanup();
+
+	DL_FOREACH_SAFE(list, t, t_tmp)
+		target_free(t);
+	free(table);
+	event_free(ev_step);
+	rank_cleanup();
+	subnet_cleanup();
+	event_base_free(ev_base);
+	munmap(map, MAX(sb.st_size, 1));
+	if (invalid) {
+		fprintf(stderr, "%s: invalid record, replay stopped\n",
+		    argv[0]);
+		return 1;
+	}
+	return 0;
+}
@@ -8,26 +8,296 @@
  */
 
 #include <sys/param.h>
+#include <sys/stat.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/util.h>
 
 #include "xping.h"
 
 extern int w_width;
+extern int J_flag;
+
+/*
+ * Streaming of results as line delimited JSON (-J), an object per
+ * result as it is marked, late replies included, per address a target
+ * resolves to and per change of state of a target with -d or -e. Lines
+ * are collected in a buffer and written in batches, when BATCH_SIZE is
+ * pending or BATCH_DELAY after the first line of a batch. A pipe or
+ * socket is written without blocking, when the reader falls behind
+ * lines are kept until it is writable again. Beyond BACKLOG_MAX
+ * pending, results are dropped and counted rather than letting memory
+ * grow or holding up probing, and a line tells how many were dropped
+ * once there is room again.
+ */
+#define BATCH_SIZE	(64 * 1024)
+#define BATCH_DELAY	100		/* milliseconds */
+#define BACKLOG_MAX	(8 * 1024 * 1024)
+
+static struct evbuffer *out;
+static struct event *ev_batch;
+static struct event *ev_out;	/* writable, when written without blocking */
+static int oflags = -1;
+static unsigned long events;
+static unsigned long dropped;
+static unsigned long dropped_total;
+static unsigned long batches;
+static const struct timeval *clock_tv;	/* time of results, when replayed */
+
+static void writable(int, short, void *);
+
+/*
+ * Write what is pending, as much as the reader takes without blocking
+ * the rest when it is writable again.
+ */
+static void
+flush(void)
+{
+	int n;
+
+	event_del(ev_batch);
+	while (evbuffer_get_length(out) > 0) {
+		n = evbuffer_write(out, STDOUT_FILENO);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && ev_out != NULL &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			event_add(ev_out, NULL);
+			return;
+		}
+		if (n <= 0) {
+			/* reader gone, nothing more to write */
+			evbuffer_drain(out, evbuffer_get_length(out));
+			return;
+		}
+		batches++;
+	}
+}
+
+static void
+writable(int fd, short what, void *thunk)
+{
+
+	flush();
+}
+
+static void
+batch(int fd, short what, void *thunk)
+{
+
+	flush();
+}
+
+/*
+ * A line is complete, write it with the batch.
+ */
+static void
+queue(void)
+{
+	struct timeval tv;
+
+	if (ev_out != NULL && event_pending(ev_out, EV_WRITE, NULL))
+		return; /* waiting for the reader */
+	if (evbuffer_get_length(out) >= BATCH_SIZE) {
+		flush();
+	} else if (!event_pending(ev_batch, EV_TIMEOUT, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = BATCH_DELAY * 1000;
+		event_add(ev_batch, &tv);
+	}
+}
+
+/*
+ * Start a line, unless too much is pending. Tells of results dropped
+ * since the last line.
+ */
+static int
+start(struct timeval *now)
+{
+
+	if (evbuffer_get_length(out) >= BACKLOG_MAX) {
+		dropped++;
+		dropped_total++;
+		return -1;
+	}
+	if (clock_tv != NULL)
+		*now = *clock_tv;
+	else
+		evutil_gettimeofday(now, NULL);
+	if (dropped > 0) {
+		evbuffer_add_printf(out,
+		    "{\"time\":%ld.%06ld,\"dropped\":%lu}\n",
+		    (long)now->tv_sec, (long)now->tv_usec, dropped);
+		dropped = 0;
+	}
+	events++;
+	return 0;
+}
+
+/*
+ * Add a string as JSON, quoted and escaped.
+ */
+static void
+addstring(const char *s)
+{
+
+	evbuffer_add(out, "\"", 1);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			evbuffer_add_printf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			evbuffer_add_printf(out, "\\u%04x", (unsigned char)*s);
+		else
+			evbuffer_add(out, s, 1);
+	}
+	evbuffer_add(out, "\"", 1);
+}
 
 void report_init()
 {
+	struct stat sb;
+
+	if (!J_flag)
+		return;
+	out = evbuffer_new();
+	ev_batch = event_new(ev_base, -1, 0, batch, NULL);
+	if (fstat(STDOUT_FILENO, &sb) == 0 &&
+	    (S_ISFIFO(sb.st_mode) || S_ISSOCK(sb.st_mode)) &&
+	    (oflags = fcntl(STDOUT_FILENO, F_GETFL)) != -1 &&
+	    fcntl(STDOUT_FILENO, F_SETFL, oflags | O_NONBLOCK) != -1)
+		ev_out = event_new(ev_base, STDOUT_FILENO, EV_WRITE, writable,
+		    NULL);
 }
 
 void report_update(struct target *t)
 {
 }
 
+/*
+ * A result was marked (-J), with the round trip time in microseconds
+ * or -1 when not timed.
+ */
+void
+report_result(struct target *t, int seq, long rtt)
+{
+	struct timeval now;
+
+	if (out == NULL || start(&now) < 0)
+		return;
+	evbuffer_add_printf(out, "{\"time\":%ld.%06ld,\"target\":",
+	    (long)now.tv_sec, (long)now.tv_usec);
+	addstring(t->host);
+	evbuffer_add_printf(out, ",\"seq\":%d,\"result\":\"", seq);
+	if (t->res[seq % NUM] == '"' || t->res[seq % NUM] == '\\')
+		evbuffer_add(out, "\\", 1);
+	evbuffer_add(out, &t->res[seq % NUM], 1);
+	evbuffer_add(out, "\"", 1);
+	if (rtt >= 0)
+		evbuffer_add_printf(out, ",\"rtt\":%ld.%03ld", rtt / 1000,
+		    rtt % 1000);
+	evbuffer_add(out, "}\n", 2);
+	queue();
+}
+
+/*
+ * A target resolved to an address (-J), taking latency microseconds to
+ * resolve, -1 if unknown.
+ */
+void
+report_resolved(struct target *t, long latency)
+{
+	struct timeval now;
+	char addr[INET6_ADDRSTRLEN];
+	void *src;
+
+	if (out == NULL)
+		return;
+	if (t->addr.sa.sa_family == AF_INET6)
+		src = &t->addr.sin6.sin6_addr;
+	else if (t->addr.sa.sa_family == AF_INET)
+		src = &t->addr.sin.sin_addr;
+	else
+		return;
+	if (evutil_inet_ntop(t->addr.sa.sa_family, src, addr,
+	    sizeof(addr)) == NULL || start(&now) < 0)
+		return;
+	evbuffer_add_printf(out, "{\"time\":%ld.%06ld,\"target\":",
+	    (long)now.tv_sec, (long)now.tv_usec);
+	addstring(t->host);
+	evbuffer_add_printf(out, ",\"address\":\"%s\"", addr);
+	if (latency >= 0)
+		evbuffer_add_printf(out, ",\"latency\":%ld.%03ld",
+		    latency / 1000, latency % 1000);
+	evbuffer_add(out, "}\n", 2);
+	queue();
+}
+
+/*
+ * A target changed state (-J with -d or -e).
+ */
+void
+report_event(struct target *t, int seq, const char *state, const char *from)
+{
+	struct timeval now;
+
+	if (out == NULL || start(&now) < 0)
+		return;
+	evbuffer_add_printf(out, "{\"time\":%ld.%06ld,\"target\":",
+	    (long)now.tv_sec, (long)now.tv_usec);
+	addstring(t->host);
+	evbuffer_add_printf(out, ",\"seq\":%d,\"state\":\"%s\","
+	    "\"from\":\"%s\"}\n", seq, state, from);
+	queue();
+}
+
+/*
+ * Give results the time they were logged, rather than the current time
+ * (xping-replay).
+ */
+void
+report_clock(const struct timeval *tv)
+{
+
+	clock_tv = tv;
+}
+
+void
+report_stats(stats_cb_type cb, void *thunk)
+{
+
+	if (out == NULL)
+		return;
+	cb("report_events", events, thunk);
+	cb("report_batches", batches, thunk);
+	cb("report_backlog", evbuffer_get_length(out), thunk);
+	cb("report_dropped", dropped_total, thunk);
+}
+
 void report_cleanup()
 {
 	struct target *t;
 	int i, imax, ifirst, ilast;
 
+	if (out != NULL) {
+		/* write out the rest, waiting for the reader */
+		if (oflags != -1)
+			fcntl(STDOUT_FILENO, F_SETFL, oflags);
+		if (ev_out != NULL)
+			event_free(ev_out);
+		ev_out = NULL;
+		flush();
+		event_free(ev_batch);
+		evbuffer_free(out);
+		out = NULL;
+		return;
+	}
+
 	t = list;
 	if (t == NULL)
 		return;
@@ -47,4 +317,3 @@ void report_cleanup()
 		fputc('\n', stdout);
 	}
 }
-
@@ -0,0 +1,157 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <math.h>
+#include <string.h>
+
+#include "xping.h"
+
+/*
+ * Sketches of round trip times, giving quantiles within SKETCH_ALPHA of
+ * the actual time from a fixed number of counts, however many times
+ * were added (DDSketch). A time falls in bin i when it is within
+ * (gamma^(i-1), gamma^i] microseconds, gamma being (1 + alpha) / (1 -
+ * alpha), and the middle of a bin is within alpha of any time in it.
+ *
+ * A sketch keeps SKETCH_BINS bins in a row, which spans times from the
+ * lowest to about 160 times as much. A time beyond that moves the row
+ * up, and bins falling off below are added to the lowest one, so the
+ * high quantiles stay accurate and only those far below them lose
+ * accuracy. Sketches of different targets have the same bins and are
+ * merged by adding counts, e.g. for a prefix or a hostname expanded to
+ * its addresses.
+ */
+#define SKETCH_ALPHA	0.02
+
+static double lngamma;	/* log of gamma, once known */
+
+static double
+loggamma(void)
+{
+
+	if (lngamma == 0)
+		lngamma = log((1 + SKETCH_ALPHA) / (1 - SKETCH_ALPHA));
+	return lngamma;
+}
+
+static int
+index_of(long rtt)
+{
+
+	if (rtt <= 1)
+		return 0;
+	return (int)ceil(log(rtt) / loggamma());
+}
+
+/*
+ * Make bin 0 the one of index lo, adding those below to it.
+ */
+static void
+shift(struct sketch *s, int lo)
+{
+	unsigned int bins[SKETCH_BINS];
+	int i, j;
+
+	memset(bins, 0, sizeof(bins));
+	for (i = 0; i < SKETCH_BINS; i++) {
+		j = MAX(s->lo + i - lo, 0);
+		if (j < SKETCH_BINS)
+			bins[j] += s->bins[i];
+	}
+	memcpy(s->bins, bins, sizeof(bins));
+	s->lo = lo;
+}
+
+static void
+addbin(struct sketch *s, int i, unsigned long n)
+{
+
+	if (s->count == 0) {
+		memset(s->bins, 0, sizeof(s->bins));
+		s->lo = i - SKETCH_BINS / 2;
+		s->top = i;
+	} else if (i >= s->lo + SKETCH_BINS) {
+		shift(s, i - SKETCH_BINS + 1);
+	} else if (i < s->lo && s->top - i < SKETCH_BINS) {
+		shift(s, s->top - SKETCH_BINS + 1);
+	}
+	s->top = MAX(s->top, i);
+	s->bins[MAX(i - s->lo, 0)] += n;
+	s->count += n;
+}
+
+/*
+ * Add a round trip time, microseconds.
+ */
+void
+sketch_add(struct sketch *s, long rtt)
+{
+
+	addbin(s, index_of(rtt), 1);
+}
+
+/*
+ * Add the times of one sketch to another.
+ */
+void
+sketch_merge(struct sketch *dst, const struct sketch *src)
+{
+	int i;
+
+	for (i = 0; i < SKETCH_BINS && src->count > 0; i++)
+		if (src->bins[i] > 0)
+			addbin(dst, src->lo + i, src->bins[i]);
+}
+
+/*
+ * Take the times of a sketch merged before off another. Bins the other
+ * has added below its lowest are taken off that one.
+ */
+void
+sketch_subtract(struct sketch *dst, const struct sketch *src)
+{
+	unsigned int n;
+	int i, j;
+
+	for (i = 0; i < SKETCH_BINS && src->count > 0; i++) {
+		if (src->bins[i] == 0 || dst->count == 0)
+			continue;
+		j = MIN(MAX(src->lo + i - dst->lo, 0), SKETCH_BINS - 1);
+		n = MIN(src->bins[i], dst->bins[j]);
+		dst->bins[j] -= n;
+		dst->count -= n;
+	}
+}
+
+/*
+ * Round trip time below which a fraction q of them are, microseconds,
+ * or -1 when none were added.
+ */
+double
+sketch_quantile(const struct sketch *s, double q)
+{
+	unsigned long n = 0, rank;
+	int i;
+
+	if (s->count == 0)
+		return -1;
+	/* nearest rank */
+	rank = q * s->count;
+	if (rank < q * s->count || rank == 0)
+		rank++;
+	for (i = 0; i < SKETCH_BINS - 1; i++) {
+		n += s->bins[i];
+		if (n >= rank)
+			break;
+	}
+	/* middle of the bin */
+	return 2 * exp((s->lo + i) * loggamma()) / (1 + exp(loggamma()));
+}
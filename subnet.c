@@ -0,0 +1,407 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "xping.h"
+
+/*
+ * Targets by address in a radix tree, one per family, for the subnet
+ * roll-up view. Paths are compressed: a node is either an address of
+ * targets or where addresses below differ, so the tree is at most as
+ * deep as addresses are long. Every node adds up the results of the
+ * targets below it. A target keeps what it added, and when its results
+ * change only the difference is carried up from its address to the
+ * root, without looking at other targets. Nodes merge the sketches of
+ * round trip times of targets below, each time added as it comes.
+ */
+struct subnet {
+	unsigned char	key[16];
+	int		af;
+	int		len;		/* prefix length, bits */
+	int		refs;		/* targets of this address */
+	struct rollup	sum;
+	struct sketch	rtts;
+	struct subnet	*parent;
+	struct subnet	*child[2];
+};
+
+static struct subnet *roots[2];	/* IPv4, IPv6 */
+
+#define ROOT(af) (&roots[(af) == AF_INET6])
+
+static int
+keylen(int af)
+{
+
+	return (af == AF_INET6 ? 128 : 32);
+}
+
+static int
+bit(const unsigned char *key, int i)
+{
+
+	return (key[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/*
+ * First bit where two keys differ, looking at no more than len bits.
+ */
+static int
+diffbit(const unsigned char *a, const unsigned char *b, int len)
+{
+	int i = 0;
+
+	while (i < len && a[i / 8] == b[i / 8])
+		i += 8;
+	while (i < len && bit(a, i) == bit(b, i))
+		i++;
+	return MIN(i, len);
+}
+
+static struct subnet *
+newnode(int af, const unsigned char *key, int len)
+{
+	struct subnet *s;
+	int i;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->af = af;
+	s->len = len;
+	memcpy(s->key, key, keylen(af) / 8);
+	for (i = len; i < keylen(af); i++)
+		s->key[i / 8] &= ~(0x80 >> (i % 8));
+	return s;
+}
+
+/*
+ * Put a node where another one was, below its parent or as root.
+ */
+static void
+replace(struct subnet *old, struct subnet *new)
+{
+
+	new->parent = old->parent;
+	if (old->parent == NULL)
+		*ROOT(old->af) = new;
+	else
+		old->parent->child[old->parent->child[1] == old] = new;
+}
+
+/*
+ * Find the node of an address, adding it if needed. A new address
+ * splits the node where it differs from the addresses already known.
+ */
+static struct subnet *
+insert(int af, const unsigned char *key)
+{
+	struct subnet **root = ROOT(af);
+	struct subnet *s, *leaf, *split;
+	int len = keylen(af);
+	int d, b;
+
+	if (*root == NULL) {
+		*root = newnode(af, key, len);
+		return *root;
+	}
+	for (s = *root; ; s = s->child[b]) {
+		d = diffbit(s->key, key, s->len);
+		if (d == len)
+			return s;
+		if (d < s->len)
+			break;
+		b = bit(key, s->len);
+	}
+	leaf = newnode(af, key, len);
+	split = newnode(af, key, d);
+	if (leaf == NULL || split == NULL) {
+		free(leaf);
+		free(split);
+		return NULL;
+	}
+	replace(s, split);
+	split->sum = s->sum;
+	split->rtts = s->rtts;
+	b = bit(key, d);
+	split->child[b] = leaf;
+	split->child[!b] = s;
+	leaf->parent = split;
+	s->parent = split;
+	return leaf;
+}
+
+/*
+ * Remove the node of an address no longer used, and the node where it
+ * split off as it now has a single child.
+ */
+static void
+erase(struct subnet *leaf)
+{
+	struct subnet *p = leaf->parent;
+
+	if (p == NULL) {
+		*ROOT(leaf->af) = NULL;
+	} else {
+		replace(p, p->child[p->child[0] == leaf]);
+		free(p);
+	}
+	free(leaf);
+}
+
+/*
+ * Add results to a node and all nodes above it.
+ */
+static void
+propagate(struct subnet *s, const struct rollup *r)
+{
+
+	for (; s != NULL; s = s->parent) {
+		s->sum.targets += r->targets;
+		s->sum.down += r->down;
+		s->sum.probes += r->probes;
+		s->sum.lost += r->lost;
+		s->sum.rtts += r->rtts;
+		s->sum.rttsum += r->rttsum;
+	}
+}
+
+/*
+ * What a target adds to the prefixes it is within. Recent loss is as
+ * ranked, so rank_update() comes first.
+ */
+static void
+contribution(struct target *t, struct rollup *r)
+{
+
+	memset(r, 0, sizeof(*r));
+	r->targets = 1;
+	r->probes = MIN(MAX(t->npkts - 1 - t->first, 0), LOSS_WINDOW);
+	r->lost = MIN(t->loss, r->probes);
+	r->down = (r->probes > 0 && r->lost == r->probes);
+	if (t->srtt >= 0) {
+		r->rtts = 1;
+		r->rttsum = t->srtt;
+	}
+}
+
+/*
+ * Index a target by its address, if it has one.
+ */
+int
+subnet_add(struct target *t)
+{
+	const unsigned char *key;
+	struct subnet *s;
+	int af = t->addr.sa.sa_family;
+
+	if (t->subnet != NULL || t->expanded)
+		return 0;
+	if (af == AF_INET6)
+		key = (const unsigned char *)&t->addr.sin6.sin6_addr;
+	else if (af == AF_INET)
+		key = (const unsigned char *)&t->addr.sin.sin_addr;
+	else
+		return 0;
+	s = insert(af, key);
+	if (s == NULL)
+		return -1;
+	s->refs++;
+	t->subnet = s;
+	memset(&t->rollup, 0, sizeof(t->rollup));
+	subnet_update(t);
+	for (; s != NULL; s = s->parent)
+		sketch_merge(&s->rtts, &t->rttsketch);
+	return 0;
+}
+
+void
+subnet_remove(struct target *t)
+{
+	struct subnet *s = t->subnet, *p;
+	struct rollup r;
+
+	if (s == NULL)
+		return;
+	memset(&r, 0, sizeof(r));
+	r.targets = -t->rollup.targets;
+	r.down = -t->rollup.down;
+	r.probes = -t->rollup.probes;
+	r.lost = -t->rollup.lost;
+	r.rtts = -t->rollup.rtts;
+	r.rttsum = -t->rollup.rttsum;
+	propagate(s, &r);
+	for (p = s; p != NULL; p = p->parent)
+		sketch_subtract(&p->rtts, &t->rttsketch);
+	t->subnet = NULL;
+	if (--s->refs == 0)
+		erase(s);
+}
+
+/*
+ * Results of a target changed, carry the difference up the tree.
+ */
+void
+subnet_update(struct target *t)
+{
+	struct rollup r, d;
+
+	if (t->subnet == NULL)
+		return;
+	contribution(t, &r);
+	d.targets = r.targets - t->rollup.targets;
+	d.down = r.down - t->rollup.down;
+	d.probes = r.probes - t->rollup.probes;
+	d.lost = r.lost - t->rollup.lost;
+	d.rtts = r.rtts - t->rollup.rtts;
+	d.rttsum = r.rttsum - t->rollup.rttsum;
+	if (d.targets == 0 && d.down == 0 && d.probes == 0 && d.lost == 0 &&
+	    d.rtts == 0 && d.rttsum == 0)
+		return;
+	propagate(t->subnet, &d);
+	t->rollup = r;
+}
+
+/*
+ * A round trip time was added to the sketch of a target, add it to the
+ * prefixes it is within.
+ */
+void
+subnet_rtt(struct target *t, long rtt)
+{
+	struct subnet *s;
+
+	for (s = t->subnet; s != NULL; s = s->parent)
+		sketch_add(&s->rtts, rtt);
+}
+
+/*
+ * Prefixes in view, IPv4 first, each followed by those within it down
+ * to the given level.
+ */
+struct walk {
+	struct subnet	**out;
+	int		skip;
+	int		k;
+	int		level;
+	int		n;
+};
+
+static void
+walk(struct subnet *s, int depth, struct walk *w)
+{
+
+	if (s == NULL || depth >= w->level)
+		return;
+	if (w->out != NULL && w->n >= w->skip + w->k)
+		return;
+	if (w->out != NULL && w->n >= w->skip)
+		w->out[w->n - w->skip] = s;
+	w->n++;
+	walk(s->child[0], depth + 1, w);
+	walk(s->child[1], depth + 1, w);
+}
+
+int
+subnet_count(int level)
+{
+	struct walk w = { NULL, 0, 0, level, 0 };
+
+	walk(roots[0], 0, &w);
+	walk(roots[1], 0, &w);
+	return w.n;
+}
+
+/*
+ * Find k prefixes after skipping the first ones. Returns the number
+ * found.
+ */
+int
+subnet_visible(struct subnet **out, int skip, int k, int level)
+{
+	struct walk w = { out, skip, k, level, 0 };
+
+	walk(roots[0], 0, &w);
+	walk(roots[1], 0, &w);
+	return MAX(w.n - skip, 0);
+}
+
+/*
+ * Describe a prefix, indented by its depth with the prefix in a column
+ * of the given width.
+ */
+void
+subnet_print(struct subnet *s, char *buf, size_t len, int width)
+{
+	struct subnet *p;
+	char addr[INET6_ADDRSTRLEN];
+	char label[INET6_ADDRSTRLEN + 4];
+	char rtt[16], p99[16];
+	int depth = 0;
+
+	for (p = s->parent; p != NULL; p = p->parent)
+		depth++;
+	if (evutil_inet_ntop(s->af, s->key, addr, sizeof(addr)) == NULL)
+		addr[0] = '\0';
+	if (s->len < keylen(s->af))
+		snprintf(label, sizeof(label), "%s/%d", addr, s->len);
+	else
+		snprintf(label, sizeof(label), "%s", addr);
+	if (s->sum.rtts > 0)
+		snprintf(rtt, sizeof(rtt), "%.1f ms",
+		    s->sum.rttsum / s->sum.rtts / 1000.0);
+	else
+		snprintf(rtt, sizeof(rtt), "- ms");
+	if (s->rtts.count > 0)
+		snprintf(p99, sizeof(p99), "%.1f ms",
+		    sketch_quantile(&s->rtts, 0.99) / 1000.0);
+	else
+		snprintf(p99, sizeof(p99), "- ms");
+	snprintf(buf, len, "%*s%-*s %6d targets %6d down %5.1f%% loss %10s "
+	    "%10s p99", 2 * depth, "", MAX(width - 2 * depth, 0), label,
+	    s->sum.targets, s->sum.down, s->sum.probes > 0 ?
+	    100.0 * s->sum.lost / s->sum.probes : 0.0, rtt, p99);
+}
+
+/*
+ * Are all targets within a prefix down.
+ */
+int
+subnet_down(struct subnet *s)
+{
+
+	return (s->sum.targets > 0 && s->sum.down == s->sum.targets);
+}
+
+static void
+freetree(struct subnet *s)
+{
+
+	if (s == NULL)
+		return;
+	freetree(s->child[0]);
+	freetree(s->child[1]);
+	free(s);
+}
+
+void
+subnet_cleanup(void)
+{
+
+	freetree(roots[0]);
+	freetree(roots[1]);
+	roots[0] = roots[1] = NULL;
+}
@@ -0,0 +1,185 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xping.h"
+
+extern int w_width;
+
+/*
+ * Summary of every target (-s), kept as results are marked so a run of
+ * any length is summed up without going over its results again. A
+ * probe counts once, by the first result marked for it: lost unless a
+ * reply came in time, a late reply or an unreachable after a probe
+ * already marked missing changes nothing. An outage is a run of lost
+ * probes, and a transition a change between replies and losses.
+ *
+ * Percentiles of round trip times are found from the sketch of the
+ * target, within about 2% of the actual time. A hostname expanded to
+ * its addresses sums them up, and a last line all targets.
+ */
+
+/*
+ * A result was marked for a probe, over the one it had.
+ */
+void
+summary_result(struct target *t, int seq, int old, long rtt)
+{
+	struct summary *s = &t->summary;
+	int lost;
+
+	if (old != ' ' || t->res[seq % NUM] == ' ')
+		return;
+	lost = (t->res[seq % NUM] != '.');
+	if (s->probes > 0 && lost != s->down)
+		s->transitions++;
+	s->down = lost;
+	s->probes++;
+	if (lost) {
+		s->lost++;
+		s->run++;
+		s->longest = MAX(s->longest, s->run);
+	} else {
+		s->run = 0;
+	}
+	if (rtt < 0)
+		return;
+	if (s->rtts == 0 || rtt < s->rttmin)
+		s->rttmin = rtt;
+	if (s->rtts == 0 || rtt > s->rttmax)
+		s->rttmax = rtt;
+	s->rtts++;
+	s->rttsum += rtt;
+}
+
+/*
+ * Add the summary of a target to that of a hostname or all targets.
+ */
+static void
+merge(struct summary *sum, struct sketch *rtts, struct target *t)
+{
+	struct summary *s = &t->summary;
+
+	sum->probes += s->probes;
+	sum->lost += s->lost;
+	sum->transitions += s->transitions;
+	sum->longest = MAX(sum->longest, s->longest);
+	if (s->rtts > 0 && (sum->rtts == 0 || s->rttmin < sum->rttmin))
+		sum->rttmin = s->rttmin;
+	if (s->rtts > 0 && (sum->rtts == 0 || s->rttmax > sum->rttmax))
+		sum->rttmax = s->rttmax;
+	sum->rtts += s->rtts;
+	sum->rttsum += s->rttsum;
+	sketch_merge(rtts, &t->rttsketch);
+}
+
+/*
+ * Round trip time below which a fraction q of them are, microseconds.
+ */
+static double
+percentile(struct summary *s, struct sketch *rtts, double q)
+{
+
+	return MIN(MAX(sketch_quantile(rtts, q), s->rttmin), s->rttmax);
+}
+
+static void
+print_ms(FILE *fp, const char *fmt, double us, int timed)
+{
+
+	if (timed)
+		fprintf(fp, fmt, us / 1000.0);
+	else
+		fprintf(fp, "%9s", "-");
+}
+
+static void
+print_row(FILE *fp, int json, const char *label, struct summary *s,
+    struct sketch *rtts)
+{
+	double loss, outage;
+	const char *p;
+
+	loss = (s->probes > 0 ? 100.0 * s->lost / s->probes : 0.0);
+	outage = s->longest * (i_interval / 1000.0);
+	if (!json) {
+		fprintf(fp, "%*.*s %8lu %6.1f", w_width, w_width, label,
+		    s->probes, loss);
+		print_ms(fp, " %8.3f", s->rttmin, s->rtts > 0);
+		print_ms(fp, " %8.3f", s->rtts > 0 ?
+		    (double)s->rttsum / s->rtts : 0, s->rtts > 0);
+		print_ms(fp, " %8.3f", percentile(s, rtts, 0.5), s->rtts > 0);
+		print_ms(fp, " %8.3f", percentile(s, rtts, 0.99),
+		    s->rtts > 0);
+		print_ms(fp, " %8.3f", s->rttmax, s->rtts > 0);
+		fprintf(fp, " %7.1fs %6lu\n", outage, s->transitions);
+		return;
+	}
+	fprintf(fp, "{\"target\":\"");
+	for (p = label; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\')
+			fputc('\\', fp);
+		if ((unsigned char)*p >= 0x20)
+			fputc(*p, fp);
+	}
+	fprintf(fp, "\",\"sent\":%lu,\"lost\":%lu,\"loss\":%.2f",
+	    s->probes, s->lost, loss);
+	if (s->rtts > 0)
+		fprintf(fp, ",\"rtt_min\":%.3f,\"rtt_avg\":%.3f,"
+		    "\"rtt_p50\":%.3f,\"rtt_p99\":%.3f,"
+		    "\"rtt_max\":%.3f", s->rttmin / 1000.0,
+		    (double)s->rttsum / s->rtts / 1000.0,
+		    percentile(s, rtts, 0.5) / 1000.0,
+		    percentile(s, rtts, 0.99) / 1000.0, s->rttmax / 1000.0);
+	fprintf(fp, ",\"outage\":%.1f,\"transitions\":%lu}\n",
+	    outage, s->transitions);
+}
+
+/*
+ * Write the summary of all targets, as a table or as line delimited
+ * JSON. A hostname expanded to its addresses is summed up from them,
+ * and a line for all targets follows when there are several.
+ */
+void
+summary_print(FILE *fp, int json)
+{
+	struct target *t, *a;
+	struct summary sum, all;
+	struct sketch rtts, allrtts;
+	int n = 0;
+
+	memset(&all, 0, sizeof(all));
+	memset(&allrtts, 0, sizeof(allrtts));
+	if (!json)
+		fprintf(fp, "%*s %8s %6s %9s %9s %9s %9s %9s %8s %6s\n",
+		    w_width, "target", "sent", "loss%", "min", "avg", "p50",
+		    "p99", "max", "outage", "trans");
+	DL_FOREACH(list, t) {
+		if (!t->expanded) {
+			print_row(fp, json, t->host, &t->summary,
+			    &t->rttsketch);
+			merge(&all, &allrtts, t);
+			n++;
+			continue;
+		}
+		/* not probed, its addresses are */
+		memset(&sum, 0, sizeof(sum));
+		memset(&rtts, 0, sizeof(rtts));
+		for (a = t->next; a != NULL && a->parent == t; a = a->next)
+			merge(&sum, &rtts, a);
+		print_row(fp, json, t->host, &sum, &rtts);
+	}
+	if (n > 1)
+		print_row(fp, json, "(all)", &all, &allrtts);
+	fflush(fp);
+}
@@ -11,12 +11,20 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <event2/event.h>
+
 #ifndef NCURSES
 #define stdscr
 #else /* NCURSES */
@@ -25,15 +33,116 @@
 
 #include "xping.h"
 
+/*
+ * Updates only record what needs redrawing, frames are drawn from a
+ * timer at most FRAME_RATE times per second.
+ */
+#define FRAME_RATE 30
+
 static int ifirst_state = -1;
-static int holding_row = 0;
 static int labelwidth;
 
+/*
+ * Viewport, the targets shown when there are more than fit on the
+ * terminal. It is scrolled from the keyboard.
+ */
+static int top;			/* first target shown */
+static int view;		/* number of targets shown */
+static struct target **shown;
+static struct event *ev_keys;
+
+/*
+ * Worst offenders view, targets ordered by RANK_LOSS or RANK_RTT
+ * instead of as listed, toggled from the keyboard.
+ */
+static int sorted;
+
+/*
+ * Subnet roll-up view, prefixes of the targets instead of the targets,
+ * down to a level of the tree which is changed from the keyboard.
+ */
+static int subnets;
+static int level = 2;
+static struct subnet **prefixes;
+
+static int damaged;		/* all rows need redrawing */
+static struct event *ev_frame;
+static struct timeval tv_frame;	/* when last frame was drawn */
+
 extern int w_width;
+extern struct event_base *ev_base;
+
+/*
+ * Colors, or rather attributes, of results (-B) and labels (-C).
+ */
+#define ATTR_NONE	0
+#define ATTR_LABEL6	8
+#define ATTR_LABEL4	9
+
+static const char *attrs[] = {
+	"",
+	"\x1b[2;34m",	/* blue */
+	"\x1b[6;33m",	/* yellow */
+	"\x1b[1;31m",	/* red */
+	"\x1b[2;35m",	/* magenta */
+	"\x1b[5;32m",	/* green */
+	"\x1b[3;31m",	/* red */
+	"\x1b[5;33m",	/* yellow */
+	"\x1b[2;32m",	/* IPv6 label, green */
+	"\x1b[2;31m",	/* IPv4 label, red */
+};
 
 #ifndef NCURSES
+/*
+ * The screen is kept as two grids of cells, one as the terminal shows
+ * it (front) and one as it should be (back). Rows are rebuilt into the
+ * back grid when damaged, and a frame writes only the cells differing
+ * from the front grid. Output of a frame is collected in a buffer and
+ * written at once.
+ */
+struct cell {
+	char		ch;
+	unsigned char	attr;
+};
+
+static struct cell *front;
+static struct cell *back;
+static char *dirty;
+static int rows;
+static int cols;
+
+static char *outbuf;
+static size_t outlen;
+static size_t outsize;
+static int pen;			/* attribute in effect on the terminal */
+static int cur_row, cur_col;	/* cursor position */
+
+/*
+ * A status line below tells which part of the targets is shown. Rows
+ * hold the target shown, so updates of targets off screen are ignored.
+ */
+static int status;
+
+/*
+ * Frames are written by a thread of their own, so a slow or stopped
+ * terminal never holds up the event loop and probing. A frame is
+ * handed over by swapping buffers with the writer, which owns its
+ * buffer while busy is set. No frame is drawn while the writer is
+ * busy, damage just adds up for the next one. The writer is woken
+ * through a pipe, closing it makes the writer finish.
+ */
+static char *wbuf;
+static size_t wlen;
+static size_t wsize;
+static atomic_int busy;
+static int wakeup[2] = { -1, -1 };
+static pthread_t writer_thread;
+static int writer_running;
+
 static int cursor_y;
-static char *scrbuffer;
+static int reserved;
+static int resized;
+static struct event *ev_winch;
 struct termios oterm;
 
 int
@@ -65,63 +174,162 @@ getmaxy(void)
 	else
 		return 0;
 }
-void
-move(int row, int col)
+
+/*
+ * Append to the frame output.
+ */
+static void
+emit(const char *fmt, ...)
 {
-	fprintf(stdout, "%c[u", 0x1b);
-	if (row > 0)
-		fprintf(stdout, "%c[%dB", 0x1b, row);
-	if (col > 0)
-		fprintf(stdout, "%c[%dC", 0x1b, col);
-	cursor_y = row;
+	va_list ap;
+	size_t size;
+	char *p;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(outbuf + outlen, outsize - outlen, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (outlen + n < outsize)
+			break;
+		size = MAX(outsize * 2, outlen + n + 1024);
+		p = realloc(outbuf, size);
+		if (p == NULL)
+			return;
+		outbuf = p;
+		outsize = size;
+	}
+	outlen += n;
 }
 
 static void
-clrtobot(void)
+writeall(const char *buf, size_t len)
 {
-	fprintf(stdout, "%c[J", 0x1b);
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < len) {
+		n = write(STDOUT_FILENO, buf + off, len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		off += n;
+	}
 }
 
+static void *
+writer(void *arg)
+{
+	ssize_t n;
+	char c;
+
+	for (;;) {
+		n = read(wakeup[0], &c, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		if (!atomic_load_explicit(&busy, memory_order_acquire))
+			continue;
+		writeall(wbuf, wlen);
+		atomic_store_explicit(&busy, 0, memory_order_release);
+	}
+	return NULL;
+}
+
+/*
+ * Write out the frame, by the writer if running, and start a new one.
+ */
 static void
-clrtoeol(void)
+flush(void)
 {
-	fprintf(stdout, "%c[K", 0x1b);
+	size_t size;
+	char *p;
+
+	if (!writer_running) {
+		writeall(outbuf, outlen);
+		outlen = 0;
+		return;
+	}
+	p = wbuf;
+	wbuf = outbuf;
+	outbuf = p;
+	size = wsize;
+	wsize = outsize;
+	outsize = size;
+	wlen = outlen;
+	outlen = 0;
+	atomic_store_explicit(&busy, 1, memory_order_release);
+	if (write(wakeup[1], "", 1) < 0) {
+		writeall(wbuf, wlen);
+		atomic_store_explicit(&busy, 0, memory_order_release);
+	}
 }
 
 static void
-addch(int ch)
+writer_start(void)
 {
+	sigset_t all, old;
 
-	fputc(ch, stdout);
+	if (pipe(wakeup) < 0)
+		return;
+	/* signals are for the event loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	writer_running = (pthread_create(&writer_thread, NULL, writer,
+	    NULL) == 0);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!writer_running) {
+		close(wakeup[0]);
+		close(wakeup[1]);
+	}
 }
 
 static void
-printw(const char *fmt, ...)
+writer_stop(void)
 {
-	va_list ap;
 
-	fprintf(stdout, "%c[K", 0x1b);
-	va_start(ap, fmt);
-	vfprintf(stdout, fmt, ap);
-	va_end(ap);
+	if (!writer_running)
+		return;
+	close(wakeup[1]);
+	pthread_join(writer_thread, NULL);
+	close(wakeup[0]);
+	writer_running = 0;
 }
 
+/*
+ * Position the cursor relative to the reference point, which is the
+ * first row of output.
+ */
 static void
-mvprintw(int row, int col, const char *fmt, ...)
+move(int row, int col)
 {
-	va_list ap;
 
-	move(row, col);
-	fprintf(stdout, "%c[K", 0x1b);
-	va_start(ap, fmt);
-	vfprintf(stdout, fmt, ap);
-	va_end(ap);
+	if (row == cur_row && col == cur_col)
+		return;
+	emit("%c[u", 0x1b);
+	if (row > 0)
+		emit("%c[%dB", 0x1b, row);
+	if (col > 0)
+		emit("%c[%dC", 0x1b, col);
+	cur_row = row;
+	cur_col = col;
+	cursor_y = row;
 }
 
 static void
-refresh(void)
+setpen(int attr)
 {
-	fflush(stdout);
+
+	if (attr == pen)
+		return;
+	if (pen != ATTR_NONE)
+		emit("%c[0m", 0x1b);
+	emit("%s", attrs[attr]);
+	pen = attr;
 }
 
 static void
@@ -130,7 +338,7 @@ scrollup(int n)
 	int i;
 
 	for (i=0; i < n; i++)
-		fprintf(stdout, "%cM", 0x1b);
+		emit("%cM", 0x1b);
 }
 
 static void
@@ -139,99 +347,396 @@ scrolldown(int n)
 	int i;
 
 	for (i=0; i < n; i++)
-		fprintf(stdout, "%cD", 0x1b);
+		emit("%cD", 0x1b);
 }
-#endif
 
 /*
- * Window changed: move up from current line (cursor_y) to the "first"
- * line to the origin row (cursor_y = 0), clear screen and redraw.
- * We may continue in the middle of an update, but even so the rest of the
- * interrupted update will use the new reference point for its move().
+ * Window changed: the terminal may have reflowed the output, so the
+ * next frame re-establishes the reference point and redraws all.
  */
-#ifndef NCURSES
-void
-sigwinch(int sig)
+static void
+sigwinch(int fd, short what, void *thunk)
 {
-	if (cursor_y > 0)
-		fprintf(stdout, "%c[%dA\r", 0x1b, cursor_y);
-	fprintf(stdout, "\r%c[s", 0x1b);
-	cursor_y = 0;
-	fprintf(stdout, "%c[2K\r", 0x1b);
-	clrtobot();
-	termio_update(NULL); /* XXX: this is probably a bad idea */
+
+	resized = 1;
+	termio_update(NULL);
 }
 #endif /* !NCURSES */
 
-
 /*
  * Return a color based on success/failure
 */
-static char *
+static int
 getcolor(int ch)
 {
 
 	switch(ch) {
 	case '.':
-		return "\x1b[2;34m"; /* blue */
+		return 1;
 	case ':':
-		return "\x1b[6;33m"; /* yellow */
+		return 2;
 	case '?':
 	case '#':
-		return "\x1b[1;31m"; /* red */
+		return 3;
 	case '%':
-		return "\x1b[2;35m"; /* magenta */
+		return 4;
 	case '@':
-		return "\x1b[5;32m"; /* green */
+		return 5;
 	case '!':
-		return "\x1b[3;31m"; /* red */
+		return 6;
 	case '"':
-		return "\x1b[5;33m"; /* yellow */
+		return 7;
 	}
-	return "";
+	return ATTR_NONE;
 }
 
+static int
+labelcolor(struct target *t)
+{
+
+	if (C_flag && t->af == AF_INET6)
+		return ATTR_LABEL6;
+	else if (C_flag && t->af == AF_INET)
+		return ATTR_LABEL4;
+	return ATTR_NONE;
+}
+
+/*
+ * Find the targets in view, the worst ones when sorted. Returns how
+ * many there are.
+ */
+static int
+visible(struct target **out, int k)
+{
+	struct target *t;
+	int i = 0;
+
+	if (sorted)
+		return rank_top(out, k);
+	for (t = list; t != NULL && i < top; t = t->next)
+		i++;
+	for (i = 0; t != NULL && i < k; t = t->next)
+		out[i++] = t;
+	return i;
+}
+
+#ifndef NCURSES
+/*
+ * Size the grids for the targets and terminal width. Rows come and go
+ * at the end with expanded hostnames, a change of width starts over.
+ */
+static int
+resize(int nrows, int ncols)
+{
+	struct cell *f, *b;
+	struct target **s;
+	char *d;
+	int i;
+
+	if (ncols != cols) {
+		free(front);
+		free(back);
+		free(dirty);
+		free(shown);
+		front = back = NULL;
+		dirty = NULL;
+		shown = NULL;
+		rows = 0;
+		cols = ncols;
+		resized = 1;
+	}
+	if (nrows == rows)
+		return 0;
+	f = realloc(front, MAX(nrows, 1) * cols * sizeof(*f));
+	if (f == NULL)
+		return -1;
+	front = f;
+	b = realloc(back, MAX(nrows, 1) * cols * sizeof(*b));
+	if (b == NULL)
+		return -1;
+	back = b;
+	d = realloc(dirty, MAX(nrows, 1));
+	if (d == NULL)
+		return -1;
+	dirty = d;
+	s = realloc(shown, MAX(nrows, 1) * sizeof(*s));
+	if (s == NULL)
+		return -1;
+	shown = s;
+	if (nrows < rows) {
+		/* targets removed, clear what was below */
+		setpen(ATTR_NONE);
+		move(nrows, 0);
+		emit("%c[J", 0x1b);
+	}
+	for (i = rows * cols; i < nrows * cols; i++) {
+		front[i].ch = ' ';
+		front[i].attr = ATTR_NONE;
+	}
+	for (i = rows; i < nrows; i++) {
+		dirty[i] = 1;
+		shown[i] = NULL;
+	}
+	rows = nrows;
+	return 0;
+}
+
+/*
+ * Build a row of the back grid from a target, label and the results
+ * in view.
+ */
 static void
-drawchar(int ch)
+compose(int row, struct target *t, int ifirst, int ilast)
+{
+	struct cell *c = back + row * cols;
+	int attr = labelcolor(t);
+	int col = 0;
+	int i, n;
+
+	/* right aligned label, as "%*.*s" */
+	n = w_width - strnlen(t->host, w_width);
+	for (i = 0; i < w_width && col < cols; i++, col++) {
+		c[col].ch = (i < n) ? ' ' : t->host[i - n];
+		c[col].attr = (i < n) ? ATTR_NONE : attr;
+	}
+	if (w_width && col < cols) {
+		c[col].ch = ' ';
+		c[col++].attr = ATTR_NONE;
+	}
+	for (i = ifirst; i < ilast && col < cols; i++, col++) {
+		c[col].ch = (i < t->npkts) ? t->res[i % NUM] : ' ';
+		c[col].attr = B_flag ? getcolor(c[col].ch) : ATTR_NONE;
+	}
+	for (; col < cols; col++) {
+		c[col].ch = ' ';
+		c[col].attr = ATTR_NONE;
+	}
+}
+
+/*
+ * Build a row of the back grid from a prefix.
+ */
+static void
+compose_prefix(int row, struct subnet *s)
 {
+	struct cell *c = back + row * cols;
+	char buf[256];
+	int attr = ATTR_NONE;
+	int col, n;
 
+	if (B_flag && subnet_down(s))
+		attr = getcolor('?');
+	subnet_print(s, buf, sizeof(buf), w_width);
+	n = strlen(buf);
+	for (col = 0; col < cols; col++) {
+		c[col].ch = (col < n) ? buf[col] : ' ';
+		c[col].attr = (col < n) ? attr : ATTR_NONE;
+	}
+}
 
-	if (!B_flag) {
-		addch(ch);
+/*
+ * Build the status line, telling which targets are shown.
+ */
+static void
+compose_status(int row)
+{
+	static const char *sortname[] = { "", "loss", "rtt" };
+	struct cell *c = back + row * cols;
+	char buf[128];
+	int col, n;
+
+	if (subnets)
+		n = snprintf(buf, sizeof(buf), "%*s[%d-%d of %d prefixes, "
+		    "level %d]", labelwidth, "", top + 1, top + view,
+		    subnet_count(level), level);
+	else if (sorted)
+		n = snprintf(buf, sizeof(buf), "%*s[worst %d of %d by %s]",
+		    labelwidth, "", view, numtargets, sortname[sorted]);
+	else
+		n = snprintf(buf, sizeof(buf), "%*s[%d-%d of %d]", labelwidth,
+		    "", top + 1, top + view, numtargets);
+	for (col = 0; col < cols; col++) {
+		c[col].ch = (col < n) ? buf[col] : ' ';
+		c[col].attr = ATTR_NONE;
+	}
+}
+
+/*
+ * Size the viewport to the terminal height, keeping a row for the
+ * status line and one for the cursor, and keep it within the list.
+ */
+static void
+viewport(void)
+{
+	int maxy = getmaxy();
+	int otop = top;
+	int total = subnets ? subnet_count(level) : numtargets;
+
+	if (sorted || subnets) {
+		view = (maxy > 2) ? MIN(total, maxy - 2) : total;
+		status = 1;
+	} else if (maxy <= 1 || total < maxy) {
+		view = total;
+		status = 0;
 	} else {
-		printw("%s%c\x1b[0m", getcolor(ch), ch);
+		view = MAX(maxy - 2, 1);
+		status = 1;
 	}
+	top = MIN(top, total - view);
+	top = MAX(top, 0);
+	if (top != otop)
+		damaged = 1;
 }
 
 /*
- * Update a single reponse with redrawing entire output. Initial move
- * compensates for labelwidth (plus space) and move into the current
- * packet position.
+ * Draw a frame, writing the cells that changed since last frame. Runs
+ * of cells are written without moving the cursor in between, and
+ * attributes are only changed where they differ from the previous
+ * cell written.
  */
 static void
-updatesingle(int ifirst, struct target *t)
+render(int ifirst, int ilast, int ncols)
 {
-	move(t->row, labelwidth+(t->npkts-1-ifirst));
-	drawchar(t->res[(t->npkts-1) % NUM]);
-	move(holding_row, 0);
+	struct cell *b, *f;
+	struct subnet **p;
+	int row, col, n;
+
+	/* Re-establish the reference point for move() */
+	if (cursor_y > 0)
+		emit("%c[%dA", 0x1b, cursor_y);
+	emit("\r%c[s", 0x1b);
+	cursor_y = 0;
+	cur_row = cur_col = 0;
+
+	viewport();
+	if (resize(view + status, ncols) < 0)
+		return;
+	if (resized) {
+		emit("%c[J", 0x1b);
+		for (col = 0; col < rows * cols; col++) {
+			front[col].ch = ' ';
+			front[col].attr = ATTR_NONE;
+		}
+		damaged = 1;
+		resized = 0;
+	}
+	if (rows > reserved) {
+		/* Reserve space for targets added since (expanded hostnames) */
+		setpen(ATTR_NONE);
+		move(0, 0);
+		scrolldown(rows);
+		scrollup(rows);
+		emit("\r%c[s", 0x1b);
+		cur_row = cur_col = 0;
+		reserved = rows;
+	}
+
+	if (damaged) {
+		if (subnets) {
+			p = realloc(prefixes, MAX(view, 1) * sizeof(*p));
+			if (p == NULL)
+				return;
+			prefixes = p;
+			n = subnet_visible(prefixes, top, view, level);
+			for (row = 0; row < n; row++) {
+				shown[row] = NULL; /* no targets shown */
+				compose_prefix(row, prefixes[row]);
+			}
+		} else {
+			n = visible(shown, view);
+			for (row = 0; row < n; row++) {
+				/* cache for selective updates */
+				shown[row]->row = row;
+				compose(row, shown[row], ifirst, ilast);
+			}
+		}
+		for (; row < view; row++) {
+			shown[row] = NULL;
+			for (col = 0; col < cols; col++) {
+				back[row * cols + col].ch = ' ';
+				back[row * cols + col].attr = ATTR_NONE;
+			}
+		}
+		if (status)
+			compose_status(view);
+	} else {
+		for (row = 0; row < view; row++)
+			if (dirty[row] && shown[row] != NULL)
+				compose(row, shown[row], ifirst, ilast);
+	}
+	for (row = 0; row < rows; row++) {
+		if (!damaged && !dirty[row])
+			continue;
+		dirty[row] = 0;
+		b = back + row * cols;
+		f = front + row * cols;
+		for (col = 0; col < cols; col++) {
+			if (b[col].ch == f[col].ch && b[col].attr == f[col].attr)
+				continue;
+			move(row, col);
+			setpen(b[col].attr);
+			emit("%c", b[col].ch);
+			f[col] = b[col];
+			cur_col++;
+		}
+	}
+	damaged = 0;
+	setpen(ATTR_NONE);
+	move(rows, 0);
+	flush();
+}
+#else /* NCURSES */
+static void
+drawchar(int ch)
+{
+
+	if (!B_flag) {
+		addch(ch);
+	} else {
+		printw("%s%c\x1b[0m", attrs[getcolor(ch)], ch);
+	}
 }
 
 static void
 updatefull(int ifirst, int ilast)
 {
-	struct target *t;
-	int row;
+	struct target *t, **s;
+	struct subnet **p;
+	char buf[256];
+	int row, n;
 	int i;
 
-	row = 0;
-	DL_FOREACH(list, t) {
+	/* viewport, leaving a row for the cursor */
+	n = subnets ? subnet_count(level) : numtargets;
+	view = MIN(n, MAX(LINES - 1, 1));
+	top = MAX(MIN(top, n - view), 0);
+	s = realloc(shown, MAX(view, 1) * sizeof(*s));
+	if (s == NULL)
+		return;
+	shown = s;
+	if (subnets) {
+		p = realloc(prefixes, MAX(view, 1) * sizeof(*p));
+		if (p == NULL)
+			return;
+		prefixes = p;
+		n = subnet_visible(prefixes, top, view, level);
+		for (row = 0; row < n; row++) {
+			subnet_print(prefixes[row], buf, sizeof(buf), w_width);
+			mvprintw(row, 0, "%s", buf);
+			clrtoeol();
+		}
+		move(row, 0);
+		clrtobot();
+		refresh();
+		return;
+	}
+	n = visible(shown, view);
+	for (row = 0; row < n; ) {
+		t = shown[row];
 		t->row = row; /* cache for selective updates */
-		if (C_flag && t->af == AF_INET6)
-			mvprintw(row, 0, "%c[2;32m%*.*s%c[0m",
-			    0x1b, w_width, w_width, t->host, 0x1b);
-		else if (C_flag && t->af == AF_INET)
-			mvprintw(row, 0, "%c[2;31m%*.*s%c[0m",
-			    0x1b, w_width, w_width, t->host, 0x1b);
+		if (labelcolor(t) != ATTR_NONE)
+			mvprintw(row, 0, "%s%*.*s%c[0m", attrs[labelcolor(t)],
+			    w_width, w_width, t->host, 0x1b);
 		else
 			mvprintw(row, 0, "%*.*s", w_width, w_width, t->host);
 		if (w_width)
@@ -244,96 +749,237 @@ updatefull(int ifirst, int ilast)
 		}
 		move(++row, 0);
 	}
-	holding_row = row;
+	clrtoeol();
+	clrtobot();
+	refresh();
+}
+#endif /* !NCURSES */
+
+/*
+ * Draw the frame, with the results in view given by the first target.
+ */
+static void
+frame(int fd, short what, void *thunk)
+{
+	struct target *t;
+	int col;
+	int imax, ifirst, ilast;
+#ifndef NCURSES
+	struct timeval tv;
+
+	if (atomic_load_explicit(&busy, memory_order_acquire)) {
+		/* terminal still busy with last frame, try again */
+		evutil_timerclear(&tv);
+		tv.tv_usec = 1000000 / FRAME_RATE;
+		event_add(ev_frame, &tv);
+		return;
+	}
+#endif /* !NCURSES */
+
+	evutil_gettimeofday(&tv_frame, NULL);
+	t = list;
+	if (t == NULL)
+		return;
+
+	col = getmaxx(stdscr);
+	imax = MIN(t->npkts, col - labelwidth);
+	imax = MIN(imax, NUM);
+	ifirst = (t->npkts > imax ? t->npkts - imax : 0);
+	ilast = t->npkts;
+	if (ifirst != ifirst_state)
+		damaged = 1;
+	ifirst_state = ifirst;
+#ifndef NCURSES
+	render(ifirst, ilast, MAX(col, 1));
+#else /* NCURSES */
+	updatefull(ifirst, ilast);
+#endif /* !NCURSES */
+}
+
+/*
+ * Scroll the viewport by a number of targets, kept within the list as
+ * the frame is drawn.
+ */
+static void
+viewscroll(int n)
+{
+
+	if (n < 0 && top < -n)
+		top = 0;
+	else if (n > 0 && top > INT_MAX - n)
+		top = INT_MAX;
+	else
+		top += n;
+	termio_update(NULL);
+}
+
+/*
+ * Keyboard: arrow keys or j/k scroll a line, page keys, space/b or
+ * f/b a page, and home/end or g/G to the first and last targets. s
+ * cycles the worst offenders view, p toggles the subnet view and +/-
+ * show more or fewer levels of it.
+ */
+static void
+keypress(int fd, short what, void *thunk)
+{
+	char buf[64];
+	ssize_t n, i;
+
+	n = read(fd, buf, sizeof(buf));
+	if (n <= 0) {
+		event_del(ev_keys);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (buf[i] == 0x1b && i + 2 < n && buf[i + 1] == '[') {
+			i += 2;
+			switch (buf[i]) {
+			case 'A':
+				viewscroll(-1);
+				break;
+			case 'B':
+				viewscroll(1);
+				break;
+			case 'H':
+				viewscroll(-INT_MAX);
+				break;
+			case 'F':
+				viewscroll(INT_MAX);
+				break;
+			case '5':
+				viewscroll(-view);
+				break;
+			case '6':
+				viewscroll(view);
+				break;
+			}
+			/* rest of "5~" and the like */
+			while (i + 1 < n && buf[i] >= '0' && buf[i] <= '9')
+				i++;
+			continue;
+		}
+		switch (buf[i]) {
+		case 'k':
+			viewscroll(-1);
+			break;
+		case 'j':
+			viewscroll(1);
+			break;
+		case 'b':
+			viewscroll(-view);
+			break;
+		case 'f':
+		case ' ':
+			viewscroll(view);
+			break;
+		case 'g':
+			viewscroll(-INT_MAX);
+			break;
+		case 'G':
+			viewscroll(INT_MAX);
+			break;
+		case 's':
+			subnets = 0;
+			sorted = (sorted + 1) % 3;
+			if (sorted)
+				rank_mode(sorted);
+			termio_update(NULL);
+			break;
+		case 'p':
+			subnets = !subnets;
+			sorted = 0;
+			top = 0;
+			termio_update(NULL);
+			break;
+		case '+':
+			if (level < 129)
+				level++;
+			termio_update(NULL);
+			break;
+		case '-':
+			if (level > 1)
+				level--;
+			termio_update(NULL);
+			break;
+		}
+	}
 }
 
 /*
  * Prepares the terminal for drawing. For !NCURSES this means handling
- * window resize, output buffering, scroll issues and other output mangling.
+ * window resize, scroll issues and other output mangling.
  */
 void
 termio_init(void)
 {
 #ifndef NCURSES
 	struct termios term;
-	struct target *t;
-	int x, y;
-
-	signal(SIGWINCH, sigwinch);
-	x = getmaxx();
-	y = getmaxy();
-	if (x > 0 && y > 0) {
-	scrbuffer = malloc(x * y);
-	if (scrbuffer != NULL)
-		setvbuf(stdout, scrbuffer, _IOFBF, x * y);
-	else
-		perror("malloc");
-	} else {
-		scrbuffer = NULL;
-	}
 
-	/* Reserve space on terminal */
-	cursor_y = 0;
-	DL_FOREACH(list, t) {
-		cursor_y++;
-		scrolldown(1);
-	}
-	scrollup(cursor_y);
+	ev_winch = evsignal_new(ev_base, SIGWINCH, sigwinch, NULL);
+	event_add(ev_winch, NULL);
+
+	/* Space on terminal is reserved by the first frame */
+	reserved = 0;
 
 	/* Establish reference point for move() */
-	fprintf(stdout, "\r%c[s", 0x1b);
+	emit("\r%c[s", 0x1b);
 	cursor_y = 0;
 
 	/* Avoid mangling output by disabling input echo and wrapping */
-	fprintf(stdout, "%c[7l", 0x1b);
+	emit("%c[7l", 0x1b);
+	flush();
 	if (isatty(STDOUT_FILENO) && tcgetattr(STDOUT_FILENO, &oterm) == 0) {
 		memcpy(&term, &oterm, sizeof(term));
-		term.c_lflag &= ~(ECHO | ECHONL);
+		term.c_lflag &= ~(ECHO | ECHONL | ICANON);
+		term.c_cc[VMIN] = 1;
+		term.c_cc[VTIME] = 0;
 		tcsetattr(STDOUT_FILENO, TCSAFLUSH, &term);
 	}
+	writer_start();
 #else /* NCURSES */
 	initscr();
+	cbreak();
+	noecho();
 #endif /* !NCURSES */
+	if (isatty(STDIN_FILENO)) {
+		ev_keys = event_new(ev_base, STDIN_FILENO, EV_READ | EV_PERSIST,
+		    keypress, NULL);
+		event_add(ev_keys, NULL);
+	}
 	labelwidth = (w_width > 0 ? w_width + 1 : 0);
+	ev_frame = event_new(ev_base, -1, 0, frame, NULL);
+	damaged = 1;
 }
 
 /*
- * Draws the recorded replies on the terminal.
+ * Record what needs redrawing, a single target or all of them, and
+ * schedule the next frame.
  */
 void
 termio_update(struct target *selective)
 {
-	struct target *t;
-	int col;
-
-	int imax, ifirst, ilast;
-
-	t = list;
-	if (t == NULL)
-		return;
+	struct timeval now, tv, next;
 
-	col = getmaxx(stdscr);
-	imax = MIN(t->npkts, col - labelwidth);
-	imax = MIN(imax, NUM);
-	ifirst = (t->npkts > imax ? t->npkts - imax : 0);
-	ilast = t->npkts;
-
-	if (selective != NULL && ifirst == ifirst_state) {
-		updatesingle(ifirst, selective);
-	} else {
 #ifndef NCURSES
-		/* Re-establish the reference point for move() */
-		if (cursor_y > 0)
-			fprintf(stdout, "%c[%dA\r", 0x1b, cursor_y);
-		fprintf(stdout, "\r%c[s", 0x1b);
-		cursor_y = 0;
+	if (selective == NULL || sorted || subnets)
+		damaged = 1; /* order or prefixes may change */
+	else if (selective->row >= 0 && selective->row < view &&
+	    shown[selective->row] == selective)
+		dirty[selective->row] = 1;
+	else if (!damaged)
+		return; /* off screen */
 #endif /* !NCURSES */
-		updatefull(ifirst, ilast);
-		ifirst_state = ifirst;
-		clrtoeol();
-		clrtobot();
-	}
-	refresh();
+	if (ev_frame == NULL || event_pending(ev_frame, EV_TIMEOUT, NULL))
+		return;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timerclear(&tv);
+	tv.tv_usec = 1000000 / FRAME_RATE;
+	evutil_timeradd(&tv_frame, &tv, &next);
+	if (evutil_timercmp(&next, &now, >))
+		evutil_timersub(&next, &now, &tv);
+	else
+		evutil_timerclear(&tv);
+	event_add(ev_frame, &tv);
 }
 
 /*
@@ -343,9 +989,23 @@ void
 termio_cleanup(void)
 {
 #ifndef NCURSES
-	setvbuf(stdout, NULL, _IONBF, 0);
-	if (scrbuffer)
-		free(scrbuffer);
+	/* final frame, written here once the writer is done */
+	writer_stop();
+	if (ev_frame != NULL && event_pending(ev_frame, EV_TIMEOUT, NULL))
+		frame(-1, 0, NULL);
+	if (ev_frame)
+		event_free(ev_frame);
+	if (ev_winch)
+		event_free(ev_winch);
+	if (ev_keys)
+		event_free(ev_keys);
+	free(front);
+	free(back);
+	free(dirty);
+	free(shown);
+	free(prefixes);
+	free(outbuf);
+	free(wbuf);
 	if (isatty(STDIN_FILENO))
 		tcsetattr(STDIN_FILENO, TCSAFLUSH, &oterm); // XXX: TCASOFT? see openssh
 #else /* NCURSES */
@@ -353,6 +1013,12 @@ termio_cleanup(void)
 	int col, i;
 	int imax, ifirst, ilast;
 
+	if (ev_frame)
+		event_free(ev_frame);
+	if (ev_keys)
+		event_free(ev_keys);
+	free(shown);
+	free(prefixes);
 	t = list;
 	if (t == NULL)
 		return;
@@ -365,12 +1031,9 @@ termio_cleanup(void)
 
 	endwin();
 	DL_FOREACH(list, t) {
-		if (C_flag && t->af == AF_INET6)
-			fprintf(stdout, "%c[2;32m%*.*s%c[0m",
-			    0x1b, w_width, w_width, t->host, 0x1b);
-		else if (C_flag && t->af == AF_INET)
-			fprintf(stdout, "%c[2;31m%*.*s%c[0m",
-			    0x1b, w_width, w_width, t->host, 0x1b);
+		if (labelcolor(t) != ATTR_NONE)
+			fprintf(stdout, "%s%*.*s%c[0m", attrs[labelcolor(t)],
+			    w_width, w_width, t->host, 0x1b);
 		else
 			fprintf(stdout, "%*.*s", w_width, w_width, t->host);
 		if (w_width)
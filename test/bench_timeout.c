@@ -0,0 +1,94 @@
+/*
+ * Benchmark session timeouts on the libevent timer heap versus a common
+ * timeout queue as used by xping-http. NSESSIONS concurrent sessions
+ * are armed, then repeatedly completed in random order and replaced
+ * by a new session, i.e. event_del followed by event_add.
+ *
+ * Usage:
+ *     make bench
+ */
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <event2/event.h>
+
+#define NSESSIONS 100000
+#define ROUNDS 10
+
+static void
+timeout_cb(int fd, short what, void *thunk)
+{
+}
+
+static double
+run(struct event_base *base, const struct timeval *tv, struct event **ev,
+    int *order)
+{
+	struct timeval start, end;
+	int i, r;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < NSESSIONS; i++)
+		event_add(ev[i], tv);
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NSESSIONS; i++) {
+			event_del(ev[order[i]]);
+			event_add(ev[order[i]], tv);
+		}
+	}
+	for (i = 0; i < NSESSIONS; i++)
+		event_del(ev[order[i]]);
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start.tv_sec) +
+	    (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct event_base *base;
+	struct event **ev;
+	struct timeval tv = {3, 0};
+	const struct timeval *tv_common;
+	double heap, common;
+	int *order;
+	int i, j, tmp;
+
+	base = event_base_new();
+	ev = calloc(NSESSIONS, sizeof(*ev));
+	order = calloc(NSESSIONS, sizeof(*order));
+	if (base == NULL || ev == NULL || order == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < NSESSIONS; i++) {
+		ev[i] = event_new(base, -1, 0, timeout_cb, NULL);
+		order[i] = i;
+	}
+	/* Sessions complete in random order */
+	srandom(1);
+	for (i = NSESSIONS - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	tv_common = event_base_init_common_timeout(base, &tv);
+	heap = run(base, &tv, ev, order);
+	common = run(base, tv_common, ev, order);
+	printf("%d sessions, %d rounds\n", NSESSIONS, ROUNDS);
+	printf("timer heap:     %.3fs (%.0f ns/op)\n", heap,
+	    heap * 1e9 / (NSESSIONS * (ROUNDS + 1)));
+	printf("common timeout: %.3fs (%.0f ns/op)\n", common,
+	    common * 1e9 / (NSESSIONS * (ROUNDS + 1)));
+
+	for (i = 0; i < NSESSIONS; i++)
+		event_free(ev[i]);
+	free(ev);
+	free(order);
+	event_base_free(base);
+	return 0;
+}
@@ -12,6 +12,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <regex.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -34,6 +36,7 @@ struct context {
 
 #define EXEC_MTRACE		0x01
 #define EXEC_UNREACH		0x02
+#define EXEC_MCOUNT		0x04
 #define EXEC_FDSLIM_MASK	0xf0
 #define EXEC_FDSLIM_SHIFT	4
 
@@ -69,6 +72,10 @@ exec_wd(int flags, char *file, ...)
 		if (flags & EXEC_UNREACH) {
 			setenv("LD_PRELOAD", "../unreach.so", 1);
 		}
+		if (flags & EXEC_MCOUNT) {
+			setenv("MALLOC_COUNT", "mcount", 1);
+			setenv("LD_PRELOAD", "../malloccount.so", 1);
+		}
 		if (flags & EXEC_FDSLIM_MASK) {
 			rlim.rlim_cur = rlim.rlim_max = (flags & EXEC_FDSLIM_MASK) >> EXEC_FDSLIM_SHIFT;
 			if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
@@ -112,6 +119,82 @@ err:
 	return -1;
 }
 
+/*
+ * Answer up to max_req requests with a minimal http response, storing
+ * the source port of each in ports unless NULL.
+ */
+static void
+http_respond_ports(int fd_srv, int max_req, unsigned short *ports)
+{
+	char buf[4096];
+	char response[] = "HTTP/1.0 200 OK\r\n\r\n";
+	struct sockaddr_in sin;
+	socklen_t sa_len;
+	int fd;
+	ssize_t n;
+
+	for (; max_req > 0; max_req--) {
+		sa_len = sizeof(sin);
+		fd = accept(fd_srv, (struct sockaddr *)&sin, &sa_len);
+		if (fd < 0)
+			break;
+		if (ports != NULL)
+			*ports++ = ntohs(sin.sin_port);
+		n = read(fd, buf, sizeof(buf));
+		if (n < 1)
+			break;
+		write(fd, response, strlen(response));
+		close(fd);
+	}
+}
+
+static void
+http_respond(int fd_srv, int max_req)
+{
+
+	http_respond_ports(fd_srv, max_req, NULL);
+}
+
+/*
+ * Answer max_req requests, each after a delay in microseconds.
+ */
+static void
+http_respond_delay(int fd_srv, int max_req, useconds_t delay)
+{
+	char buf[4096];
+	char response[] = "HTTP/1.0 200 OK\r\n\r\n";
+	int fd;
+
+	for (; max_req > 0; max_req--) {
+		fd = accept(fd_srv, NULL, 0);
+		if (fd < 0)
+			break;
+		if (read(fd, buf, sizeof(buf)) < 1)
+			break;
+		usleep(delay);
+		write(fd, response, strlen(response));
+		close(fd);
+	}
+}
+
+static long
+readnum(char *filename)
+{
+	char buf[64];
+	int fd;
+	ssize_t len;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 1)
+		return -1;
+	buf[len] = '\0';
+	return strtol(buf, NULL, 10);
+}
+
 static int
 regex(char *filename, const char *regex)
 {
@@ -139,6 +222,37 @@ regex(char *filename, const char *regex)
 
 }
 
+/*
+ * A number of a JSON line of the given target, or -1 if not found.
+ */
+static double
+jsonnum(char *filename, const char *target, const char *key)
+{
+	char buf[4096];
+	char pattern[128];
+	char *p, *eol;
+	int fd;
+	ssize_t len;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+	snprintf(pattern, sizeof(pattern), "{\"target\":\"%s\",", target);
+	if ((p = strstr(buf, pattern)) == NULL)
+		return -1;
+	if ((eol = strchr(p, '\n')) != NULL)
+		*eol = '\0';
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	if ((p = strstr(p, pattern)) == NULL)
+		return -1;
+	return strtod(p + strlen(pattern), NULL);
+}
+
 static int
 has_dots(char *filename)
 {
@@ -200,17 +314,14 @@ test_xping_http_localhost(void *ctx_)
 {
 	struct context *ctx = ctx_;
 	char url[32];
-	char buf[4096];
-	char response[] = "HTTP/1.0 200 OK\r\n\r\n";
 	unsigned short listen_port;
 	struct timeval tv = {2, 0};
+	unsigned short ports[4] = {0};
 	int wstatus;
 	pid_t pid;
 	int fd_srv;
-	int fd;
-	ssize_t n;
-	int max_req;
 	int exec_flags;
+	int i;
 
 	listen_port = 0;
 	fd_srv = sock_listen(&listen_port);
@@ -230,24 +341,82 @@ test_xping_http_localhost(void *ctx_)
 	} else if (strcmp(ctx->testcase->name, "fd-leakage-http") == 0) {
 		exec_flags |= 10 << EXEC_FDSLIM_SHIFT;
 	}
-	pid = exec_wd(exec_flags, "../../xping-http", "-c", "4", url, NULL);
+	if (strcmp(ctx->testcase->name, "fastopen-rst-http") == 0)
+		pid = exec_wd(exec_flags, "../../xping-http", "-FR", "-P",
+		    "47000-47009", "-c", "4", url, NULL);
+	else if (strcmp(ctx->testcase->name, "json-stream-http") == 0)
+		pid = exec_wd(exec_flags, "../../xping-http", "-J", "-c", "4",
+		    url, NULL);
+	else if (strcmp(ctx->testcase->name, "binlog-replay-http") == 0)
+		pid = exec_wd(exec_flags, "../../xping-http", "-L", "log",
+		    "-c", "4", url, NULL);
+	else if (strcmp(ctx->testcase->name, "status-board-http") == 0)
+		pid = exec_wd(exec_flags, "../../xping-http", "-S", "board",
+		    "-c", "4", url, NULL);
+	else if (strcmp(ctx->testcase->name, "summary-http") == 0)
+		pid = exec_wd(exec_flags, "../../xping-http", "-sJ", "-c", "4",
+		    url, NULL);
+	else if (strcmp(ctx->testcase->name, "state-event-http") == 0)
+		pid = exec_wd(exec_flags, "../../xping-http", "-J", "-d",
+		    "2,2,10", "-c", "4", url, NULL);
+	else
+		pid = exec_wd(exec_flags, "../../xping-http", "-c", "4", url,
+		    NULL);
 	tt_assert(pid > 0);
 	tt_assert(setsockopt(fd_srv, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
-	for (max_req = 4; max_req > 0; max_req--) {
-		fd = accept(fd_srv, NULL, 0);
-		if (fd < 0)
-			break;
-		n = read(fd, buf, sizeof(buf));
-		if (n < 1)
-			break;
-		write(fd, response, strlen(response));
-		close(fd);
+	if (strcmp(ctx->testcase->name, "fastopen-rst-http") == 0) {
+		/* counters are dumped while probing */
+		http_respond_ports(fd_srv, 2, ports);
+		kill(pid, SIGUSR1);
+		http_respond_ports(fd_srv, 2, ports + 2);
+	} else {
+		http_respond(fd_srv, 4);
 	}
 	waitpid(pid, &wstatus, 0);
 	tt_assert(WIFEXITED(wstatus));
 	tt_assert(WEXITSTATUS(wstatus) == 0);
+	if (strcmp(ctx->testcase->name, "fastopen-rst-http") == 0) {
+		for (i = 0; i < 4; i++) {
+			tt_int_op(ports[i], >=, 47000);
+			tt_int_op(ports[i], <=, 47009);
+		}
+		tt_assert(regex("stderr", "\nfastopen_syn_data [0-9]+\n"
+		    "fastopen_fallback [0-9]+\n(.*\n)?source_ports 10\n") == 0);
+		tt_assert(regex("stderr", "\nsockets_closed_rst [1-9]") == 0);
+	}
+	if (strcmp(ctx->testcase->name, "binlog-replay-http") == 0) {
+		pid = exec_wd(0, "../../xping-replay", "-s", "0", "-J", "log",
+		    NULL);
+		tt_assert(pid > 0);
+		waitpid(pid, &wstatus, 0);
+		tt_assert(WIFEXITED(wstatus));
+		tt_assert(WEXITSTATUS(wstatus) == 0);
+	} else if (strcmp(ctx->testcase->name, "status-board-http") == 0) {
+		pid = exec_wd(0, "../../xping-board", "board", NULL);
+		tt_assert(pid > 0);
+		waitpid(pid, &wstatus, 0);
+		tt_assert(WIFEXITED(wstatus));
+		tt_assert(WEXITSTATUS(wstatus) == 0);
+	}
 	if (strcmp(ctx->testcase->name, "connect-unreach-http") == 0)
 		tt_assert(regex("stdout", "[!#]{4}") == 0)
+	else if (strcmp(ctx->testcase->name, "status-board-http") == 0)
+		tt_assert(regex("stdout", "http://127\\.0\\.0\\.1:[0-9]+ +4 +4 "
+		    "+0 +0 +0 +[0-9.]+ +[0-9.]+  \\.{4}\n") == 0)
+	else if (strcmp(ctx->testcase->name, "summary-http") == 0)
+		tt_assert(regex("stdout", "\\{\"target\":\"http://127\\.0\\.0\\.1:"
+		    "[0-9]+\",\"sent\":4,\"lost\":0,\"loss\":0\\.00,"
+		    "\"rtt_min\":[0-9.]+,.*\"outage\":0\\.0,"
+		    "\"transitions\":0\\}\n") == 0)
+	else if (strcmp(ctx->testcase->name, "state-event-http") == 0)
+		tt_assert(regex("stdout", "\\{\"time\":[0-9]+\\.[0-9]{6},"
+		    "\"target\":\"http://127\\.0\\.0\\.1:[0-9]+\",\"seq\":0,"
+		    "\"state\":\"up\",\"from\":\"unknown\"\\}\n") == 0)
+	else if (strcmp(ctx->testcase->name, "json-stream-http") == 0 ||
+	    strcmp(ctx->testcase->name, "binlog-replay-http") == 0)
+		tt_assert(regex("stdout", "\\{\"time\":[0-9]+\\.[0-9]{6},"
+		    "\"target\":\"http://127\\.0\\.0\\.1:[0-9]+\",\"seq\":3,"
+		    "\"result\":\"\\.\",\"rtt\":[0-9]+\\.[0-9]{3}\\}\n") == 0)
 	else
 		tt_assert(has_dots("stdout"));
 
@@ -256,6 +425,399 @@ end:
 	;
 }
 
+/*
+ * Metrics pushed in the StatsD format are received by a local listener.
+ */
+static void
+test_push(void *ctx_)
+{
+	struct context *ctx = ctx_;
+	struct sockaddr_in sin;
+	socklen_t sa_len;
+	char url[32];
+	char port[8];
+	char buf[2048];
+	unsigned short listen_port;
+	struct timeval tv = {2, 0};
+	int wstatus;
+	pid_t pid;
+	int fd_srv, fd_udp = -1, fd_out;
+	ssize_t n;
+
+	listen_port = 0;
+	fd_srv = sock_listen(&listen_port);
+	tt_assert(fd_srv >= 0);
+	tt_assert(setsockopt(fd_srv, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%hu", listen_port);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd_udp = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(fd_udp >= 0);
+	tt_assert(bind(fd_udp, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+	sa_len = sizeof(sin);
+	tt_assert(getsockname(fd_udp, (struct sockaddr *)&sin, &sa_len) == 0);
+	tt_assert(setsockopt(fd_udp, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+	snprintf(port, sizeof(port), "%hu", ntohs(sin.sin_port));
+
+	strcpy(ctx->name, "xping-http");
+	pid = exec_wd(0, "../../xping-http", "-G", port, "-g", "0.5", "-c", "4",
+	    url, NULL);
+	tt_assert(pid > 0);
+	http_respond(fd_srv, 4);
+	waitpid(pid, &wstatus, 0);
+	tt_assert(WIFEXITED(wstatus));
+	tt_assert(WEXITSTATUS(wstatus) == 0);
+
+	fd_out = open("push", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	tt_assert(fd_out >= 0);
+	n = recv(fd_udp, buf, sizeof(buf), 0);
+	if (n > 0)
+		write(fd_out, buf, n);
+	close(fd_out);
+	tt_assert(regex("push", "^xping\\.http___127_0_0_1_[0-9]+\\.sent:[0-9]+"
+	    "\\|c\nxping\\.http___127_0_0_1_[0-9]+\\.received:[0-9]+\\|c\n")
+	    == 0);
+
+end:
+	close(fd_srv);
+	close(fd_udp);
+}
+
+/*
+ * Round trip time percentiles of the summary, of two targets answered
+ * after 50 and 200 ms and of both of them, are within the accuracy of
+ * the sketches, allowing some for the time taken by the connection.
+ */
+#define NEAR(ms, want)	((ms) >= (want) * 0.97 && (ms) <= (want) * 1.03 + 10)
+
+static void
+test_percentiles(void *ctx_)
+{
+	struct context *ctx = ctx_;
+	char url[2][32];
+	unsigned short listen_port[2] = {0, 0};
+	struct timeval tv = {2, 0};
+	int wstatus;
+	pid_t pid, child = -1;
+	int fd_srv[2] = {-1, -1};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		fd_srv[i] = sock_listen(&listen_port[i]);
+		tt_assert(fd_srv[i] >= 0);
+		tt_assert(setsockopt(fd_srv[i], SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) == 0);
+		snprintf(url[i], sizeof(url[i]), "http://127.0.0.1:%hu",
+		    listen_port[i]);
+	}
+
+	strcpy(ctx->name, "xping-http");
+	pid = exec_wd(0, "../../xping-http", "-sJ", "-c", "5",
+	    url[0], url[1], NULL);
+	tt_assert(pid > 0);
+	if ((child = fork()) == 0) {
+		http_respond_delay(fd_srv[1], 5, 200000);
+		_exit(0);
+	}
+	tt_assert(child > 0);
+	http_respond_delay(fd_srv[0], 5, 50000);
+	waitpid(child, NULL, 0);
+	waitpid(pid, &wstatus, 0);
+	tt_assert(WIFEXITED(wstatus));
+	tt_assert(WEXITSTATUS(wstatus) == 0);
+
+	tt_assert(NEAR(jsonnum("stdout", url[0], "rtt_p50"), 50));
+	tt_assert(NEAR(jsonnum("stdout", url[0], "rtt_p99"), 50));
+	tt_assert(NEAR(jsonnum("stdout", url[1], "rtt_p50"), 200));
+	tt_assert(NEAR(jsonnum("stdout", url[1], "rtt_p99"), 200));
+	tt_assert(NEAR(jsonnum("stdout", "(all)", "rtt_p50"), 50));
+	tt_assert(NEAR(jsonnum("stdout", "(all)", "rtt_p99"), 200));
+
+end:
+	for (i = 0; i < 2; i++)
+		if (fd_srv[i] >= 0)
+			close(fd_srv[i]);
+}
+
+/*
+ * Metrics are scraped while probing, once the replies to four probes
+ * are in and before the fifth is sent.
+ */
+static void
+test_metrics(void *ctx_)
+{
+	struct context *ctx = ctx_;
+	struct sockaddr_in sin;
+	char url[32];
+	char port[8];
+	char buf[4096];
+	char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	unsigned short listen_port, metrics_port;
+	struct timeval tv = {2, 0};
+	int wstatus;
+	pid_t pid;
+	int fd_srv, fd = -1, fd_out;
+	ssize_t n;
+
+	listen_port = 0;
+	fd_srv = sock_listen(&listen_port);
+	tt_assert(fd_srv >= 0);
+	tt_assert(setsockopt(fd_srv, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%hu", listen_port);
+
+	/* a port free for the exporter */
+	metrics_port = 0;
+	fd = sock_listen(&metrics_port);
+	tt_assert(fd >= 0);
+	close(fd);
+	fd = -1;
+	snprintf(port, sizeof(port), "%hu", metrics_port);
+
+	strcpy(ctx->name, "xping-http");
+	pid = exec_wd(0, "../../xping-http", "-M", port, "-c", "5", url, NULL);
+	tt_assert(pid > 0);
+	http_respond(fd_srv, 4);
+	usleep(500000);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(metrics_port);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(fd >= 0);
+	tt_assert(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+	tt_assert(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+	tt_assert(write(fd, request, strlen(request)) == strlen(request));
+	fd_out = open("metrics", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	tt_assert(fd_out >= 0);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		write(fd_out, buf, n);
+	close(fd_out);
+
+	http_respond(fd_srv, 1);
+	waitpid(pid, &wstatus, 0);
+	tt_assert(WIFEXITED(wstatus));
+	tt_assert(WEXITSTATUS(wstatus) == 0);
+	tt_assert(regex("metrics", "^HTTP/1\\.0 200 OK\r\n") == 0);
+	tt_assert(regex("metrics", "\nxping_sent_total\\{target=\"http://"
+	    "127\\.0\\.0\\.1:[0-9]+\"\\} 4\n") == 0);
+	tt_assert(regex("metrics", "\nxping_received_total\\{target=\"http://"
+	    "127\\.0\\.0\\.1:[0-9]+\"\\} 4\n") == 0);
+	tt_assert(regex("metrics", "\nxping_late_total\\{target=\"http://"
+	    "127\\.0\\.0\\.1:[0-9]+\"\\} 0\n") == 0);
+	tt_assert(regex("metrics", "\nxping_rtt_seconds_bucket\\{target=\""
+	    "http://127\\.0\\.0\\.1:[0-9]+\",le=\"2\\.5\"\\} 4\n") == 0);
+	tt_assert(regex("metrics", "\nxping_rtt_seconds_bucket\\{target=\""
+	    "http://127\\.0\\.0\\.1:[0-9]+\",le=\"\\+Inf\"\\} 4\n"
+	    "xping_rtt_seconds_sum\\{target=\"http://"
+	    "127\\.0\\.0\\.1:[0-9]+\"\\} [0-9]+\\.[0-9]{6}\n"
+	    "xping_rtt_seconds_count\\{target=\"http://"
+	    "127\\.0\\.0\\.1:[0-9]+\"\\} 4\n") == 0);
+
+end:
+	close(fd_srv);
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * A DNS cache file as written with -D, holding an address of a single
+ * hostname.
+ */
+struct cachefile {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	recsize;
+	uint32_t	count;
+	struct {
+		char		host[64];
+		int64_t		expires;
+		int		n6;
+		int		n4;
+		struct in6_addr	addr6[8];
+		struct in_addr	addr4[8];
+	} rec;
+};
+
+/*
+ * Restarting with an expired address cached, probing starts with it
+ * right away, while queries for the hostname are held back by -Q
+ * behind those of other hostnames, and reports the address as resolved
+ * from the cache. The address is kept on exit.
+ */
+static void
+test_dns_cache(void *ctx_)
+{
+	struct context *ctx = ctx_;
+	struct cachefile cf;
+	struct stat st;
+	char url[48];
+	unsigned short listen_port;
+	struct timeval tv = {2, 0};
+	int wstatus;
+	pid_t pid;
+	int fd_srv, fd;
+
+	listen_port = 0;
+	fd_srv = sock_listen(&listen_port);
+	tt_assert(fd_srv >= 0);
+	tt_assert(setsockopt(fd_srv, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+	snprintf(url, sizeof(url), "http://cached.invalid:%hu", listen_port);
+
+	memset(&cf, 0, sizeof(cf));
+	cf.magic = 0x78646e73;
+	cf.version = 2;
+	cf.recsize = sizeof(cf.rec);
+	cf.count = 1;
+	strcpy(cf.rec.host, "cached.invalid");
+	cf.rec.expires = 1;
+	cf.rec.n4 = 1;
+	cf.rec.addr4[0].s_addr = htonl(INADDR_LOOPBACK);
+	fd = open("cache", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	tt_assert(fd >= 0);
+	tt_assert(write(fd, &cf, sizeof(cf)) == sizeof(cf));
+	close(fd);
+
+	strcpy(ctx->name, "xping-http");
+	pid = exec_wd(0, "../../xping-http", "-J", "-D", "cache", "-Q", "1",
+	    "-c", "2", "http://a.invalid", "http://b.invalid",
+	    "http://c.invalid", url, NULL);
+	tt_assert(pid > 0);
+	http_respond(fd_srv, 2);
+	waitpid(pid, &wstatus, 0);
+	tt_assert(WIFEXITED(wstatus));
+	tt_assert(WEXITSTATUS(wstatus) == 0);
+	tt_assert(regex("stdout", "\\{\"time\":[0-9]+\\.[0-9]{6},"
+	    "\"target\":\"http://cached\\.invalid:[0-9]+\","
+	    "\"address\":\"127\\.0\\.0\\.1\","
+	    "\"latency\":[0-9]+\\.[0-9]{3}\\}\n") == 0);
+	tt_assert(regex("stdout", "\\{\"time\":[0-9]+\\.[0-9]{6},"
+	    "\"target\":\"http://cached\\.invalid:[0-9]+\",\"seq\":1,"
+	    "\"result\":\"\\.\",\"rtt\":[0-9]+\\.[0-9]{3}\\}\n") == 0);
+	tt_assert(stat("cache", &st) == 0);
+	tt_int_op(st.st_size, ==, sizeof(cf));
+
+end:
+	close(fd_srv);
+}
+
+/*
+ * A hostname with both an IPv6 and IPv4 address, listened on by IPv4
+ * only, is probed by falling back to IPv4 as the IPv6 connect fails.
+ * The races are counted as won by IPv4 in the counters dumped on
+ * SIGUSR1. The addresses come from the cache, with the refresh held
+ * back by -Q behind other hostnames for as long as probing lasts.
+ */
+static void
+test_race_ipv4(void *ctx_)
+{
+	struct context *ctx = ctx_;
+	struct cachefile cf;
+	char url[48];
+	unsigned short listen_port;
+	struct timeval tv = {2, 0};
+	int wstatus;
+	pid_t pid;
+	int fd_srv, fd;
+
+	listen_port = 0;
+	fd_srv = sock_listen(&listen_port);
+	tt_assert(fd_srv >= 0);
+	tt_assert(setsockopt(fd_srv, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+	snprintf(url, sizeof(url), "http://dual.invalid:%hu", listen_port);
+
+	memset(&cf, 0, sizeof(cf));
+	cf.magic = 0x78646e73;
+	cf.version = 2;
+	cf.recsize = sizeof(cf.rec);
+	cf.count = 1;
+	strcpy(cf.rec.host, "dual.invalid");
+	cf.rec.expires = 1;
+	cf.rec.n6 = 1;
+	cf.rec.addr6[0] = in6addr_loopback;
+	cf.rec.n4 = 1;
+	cf.rec.addr4[0].s_addr = htonl(INADDR_LOOPBACK);
+	fd = open("cache", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	tt_assert(fd >= 0);
+	tt_assert(write(fd, &cf, sizeof(cf)) == sizeof(cf));
+	close(fd);
+
+	strcpy(ctx->name, "xping-http");
+	pid = exec_wd(0, "../../xping-http", "-J", "-D", "cache", "-Q", "1",
+	    "-c", "4", "http://a.invalid", "http://b.invalid",
+	    "http://c.invalid", "http://d.invalid", url, NULL);
+	tt_assert(pid > 0);
+	/* counters are dumped while probing */
+	http_respond(fd_srv, 2);
+	kill(pid, SIGUSR1);
+	http_respond(fd_srv, 2);
+	waitpid(pid, &wstatus, 0);
+	tt_assert(WIFEXITED(wstatus));
+	tt_assert(WEXITSTATUS(wstatus) == 0);
+	tt_assert(regex("stdout", "\"target\":\"http://dual\\.invalid:[0-9]+\","
+	    "\"address\":\"127\\.0\\.0\\.1\"") == 0);
+	tt_assert(regex("stdout", "\"target\":\"http://dual\\.invalid:[0-9]+\","
+	    "\"seq\":3,\"result\":\"\\.\"") == 0);
+	tt_assert(regex("stderr", "\nrace_won_ipv6 0\nrace_won_ipv4 [1-9]")
+	    == 0);
+
+end:
+	close(fd_srv);
+}
+
+/*
+ * Steady state probing should not allocate per probe, thus running
+ * more probes must not cause more allocations.
+ */
+static void
+test_allocation_count(void *ctx_)
+{
+	struct context *ctx = ctx_;
+	char url[32];
+	unsigned short listen_port;
+	struct timeval tv = {2, 0};
+	int count[2];
+	long n[2];
+	int wstatus;
+	pid_t pid;
+	int fd_srv;
+	int i;
+
+	if (!exists("../malloccount.so"))
+		tt_skip();
+	listen_port = 0;
+	fd_srv = sock_listen(&listen_port);
+	tt_assert(fd_srv >= 0);
+	tt_assert(setsockopt(fd_srv, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%hu", listen_port);
+
+	strcpy(ctx->name, "xping-http");
+	count[0] = 4;
+	count[1] = 6;
+	for (i = 0; i < 2; i++) {
+		char countarg[8];
+
+		snprintf(countarg, sizeof(countarg), "%d", count[i]);
+		pid = exec_wd(EXEC_MCOUNT, "../../xping-http", "-c", countarg,
+		    url, NULL);
+		tt_assert(pid > 0);
+		http_respond(fd_srv, count[i]);
+		waitpid(pid, &wstatus, 0);
+		tt_assert(WIFEXITED(wstatus));
+		tt_assert(WEXITSTATUS(wstatus) == 0);
+		tt_assert(has_dots("stdout"));
+		n[i] = readnum("mcount");
+		tt_assert(n[i] > 0);
+	}
+	tt_int_op(n[0], ==, n[1]);
+
+end:
+	close(fd_srv);
+	;
+}
+
 static void
 test_memory_leakage(void *ctx_)
 {
@@ -333,6 +895,18 @@ struct testcase_t tc_blackbox[] = {
 	{"xping-http-localhost", test_xping_http_localhost, 0, &tc_setup},
 	{"fd-leakage-http", test_xping_http_localhost, 0, &tc_setup},
 	{"connect-unreach-http", test_xping_http_localhost, 0, &tc_setup},
+	{"fastopen-rst-http", test_xping_http_localhost, 0, &tc_setup},
+	{"json-stream-http", test_xping_http_localhost, 0, &tc_setup},
+	{"binlog-replay-http", test_xping_http_localhost, 0, &tc_setup},
+	{"status-board-http", test_xping_http_localhost, 0, &tc_setup},
+	{"summary-http", test_xping_http_localhost, 0, &tc_setup},
+	{"percentiles-http", test_percentiles, 0, &tc_setup},
+	{"state-event-http", test_xping_http_localhost, 0, &tc_setup},
+	{"statsd-push-http", test_push, 0, &tc_setup},
+	{"metrics-http", test_metrics, 0, &tc_setup},
+	{"dns-cache-http", test_dns_cache, 0, &tc_setup},
+	{"race-ipv4-http", test_race_ipv4, 0, &tc_setup},
+	{"allocation-count-http", test_allocation_count, 0, &tc_setup},
 	{"memory-leakage", test_memory_leakage, 0, &tc_setup},
 	END_OF_TESTCASES
 };
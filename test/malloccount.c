@@ -0,0 +1,54 @@
+/*
+ * Count allocator calls in LD_PRELOAD and write the count to the file
+ * named by MALLOC_COUNT when the program exits.
+ *
+ * Usage:
+ *     gcc malloccount.c -fPIC -shared -o malloccount.so
+ *     MALLOC_COUNT=count LD_PRELOAD=./malloccount.so /bin/echo 42
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long count;
+
+void *malloc(size_t size)
+{
+
+	count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+
+	count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+
+	count++;
+	return __libc_realloc(ptr, size);
+}
+
+void __count_report(void) __attribute__((destructor));
+
+void __count_report(void)
+{
+	unsigned long n = count;
+	char *p = getenv("MALLOC_COUNT");
+	FILE *fp;
+
+	if (!p)
+		return;
+	fp = fopen(p, "w");
+	if (fp == NULL)
+		return;
+	fprintf(fp, "%lu\n", n);
+	fclose(fp);
+}
@@ -0,0 +1,99 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include "xping.h"
+
+/*
+ * Recent loss of every target over windows of the last probes, kept as
+ * counts of probes without reply so ranking and exporters never go
+ * over the results again. A probe is counted as the next one is sent,
+ * and the probe falling out of a window is taken off by the result it
+ * has then. A result changing after the probe was counted, e.g. a late
+ * reply, moves the counts of the windows it is in. Like the ranking
+ * always did, the probe in flight and probes from before an address of
+ * an expanded hostname was added aren't counted, and a late reply
+ * counts as lost.
+ *
+ * Windows are at most NUM - 1 probes, the results kept.
+ */
+
+const int window_size[LOSS_WINDOWS] = { 10, LOSS_WINDOW, 60, 240 };
+
+#define LOST(c)	((c) != '.')
+
+/*
+ * The next probe is about to be sent, over the slot of the oldest
+ * result kept. The probe before it is counted.
+ */
+void
+window_probe(struct target *t)
+{
+	int i, seq = t->npkts - 1;
+
+	if (t->expanded || seq < t->first)
+		return;
+	for (i = 0; i < LOSS_WINDOWS; i++) {
+		t->window[i] += LOST(t->res[seq % NUM]);
+		if (seq - window_size[i] >= t->first)
+			t->window[i] -= LOST(t->res[(seq - window_size[i]) %
+			    NUM]);
+	}
+}
+
+/*
+ * The result of a probe changed from old. A result for a probe older
+ * than those kept lands in the slot of a newer one, and counts for it.
+ */
+void
+window_mark(struct target *t, int seq, int old)
+{
+	int i, d, p;
+
+	d = LOST(t->res[seq % NUM]) - LOST(old);
+	if (t->expanded || d == 0)
+		return;
+	p = t->npkts - 1 - ((t->npkts - 1 - seq) % NUM + NUM) % NUM;
+	if (p >= t->npkts - 1 || p < t->first)
+		return; /* in flight, or not counted */
+	for (i = 0; i < LOSS_WINDOWS; i++)
+		if (p >= t->npkts - 1 - window_size[i])
+			t->window[i] += d;
+}
+
+/*
+ * Count the windows over again, as when results are set without the
+ * probes being sent (xping-replay).
+ */
+void
+window_reset(struct target *t)
+{
+	int i, seq;
+
+	for (i = 0; i < LOSS_WINDOWS; i++) {
+		t->window[i] = 0;
+		if (t->expanded)
+			continue;
+		for (seq = MAX(t->npkts - 1 - window_size[i], t->first);
+		    seq < t->npkts - 1; seq++)
+			t->window[i] += LOST(t->res[seq % NUM]);
+	}
+}
+
+/*
+ * Probes counted in window i, fewer than its size while the target is
+ * new.
+ */
+int
+window_probes(struct target *t, int i)
+{
+
+	return MIN(MAX(t->npkts - 1 - t->first, 0), window_size[i]);
+}
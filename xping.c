@@ -36,17 +36,38 @@ int	c_count = 0;
 int	A_flag = 0;
 int	B_flag = 0;
 int	C_flag = 0;
+char	*d_alert = NULL;
+char	*e_hook = NULL;
+int	E_flag = 0;
+int	F_flag = 0;
+char	*G_push = NULL;
+int	g_interval = 10000;
+int	J_flag = 0;
+char	*L_file = NULL;
+char	*M_listen = NULL;
+int	N_flag = 0;
+int	R_flag = 0;
+int	s_flag = 0;
+char	*S_board = NULL;
 int	T_flag = 0;
 int	v4_flag = 0;
 int	v6_flag = 0;
 int	w_width = 20;
+int	p_family = AF_INET6;
+int	Q_rate = 1000;
+int	j_inflight = 64;
+char	*D_file = NULL;
+int	P_lo = 0;
+int	P_hi = 0;
 
 /* Global structures */
 int	fd4, fd4errno;
 int	fd6, fd6errno;
 struct	event_base *ev_base;
 struct	evdns_base *dns;
+struct	event *ev_stats;
 struct	timeval tv_interval;
+const struct timeval *tv_interval_common;
 int	numtargets = 0;
 int	numcomplete = 0;
 
@@ -68,6 +89,52 @@ sigint(int sig)
 	signal(SIGTERM, SIG_DFL);
 }
 
+/*
+ * Write a single counter as a "name value" line.
+ */
+static void
+stats_print(const char *name, unsigned long value, void *thunk)
+{
+	FILE *fp = thunk;
+
+	fprintf(fp, "%s %lu\n", name, value);
+}
+
+/*
+ * Give the counters of every module.
+ */
+void
+stats_walk(stats_cb_type cb, void *thunk)
+{
+
+	probe_stats(cb, thunk);
+	dnstask_stats(cb, thunk);
+	mempool_stats(cb, thunk);
+	report_stats(cb, thunk);
+	metrics_stats(cb, thunk);
+	binlog_stats(cb, thunk);
+	board_stats(cb, thunk);
+	push_stats(cb, thunk);
+	alert_stats(cb, thunk);
+}
+
+/*
+ * Dump module counters on stderr when SIGUSR1 is received, unless
+ * stderr is the terminal drawn on, where the next frames would leave
+ * them mangled.
+ */
+static void
+stats_dump(int sig, short what, void *thunk)
+{
+
+	if (ui_init == termio_init && isatty(STDERR_FILENO))
+		return;
+	stats_walk(stats_print, stderr);
+	if (s_flag)
+		summary_print(stderr, J_flag);
+	fflush(stderr);
+}
+
 /*
  * Ring the terminal bell. This includes tricks to avoid gcc alerts when
  * control flow doesn't react to the return value of write(), see also
@@ -91,17 +158,11 @@ target_probe(int fd, short what, void *thunk)
 	struct target *t = thunk;
 
 	/* Missed request */
-	if (t->npkts > 0 && GETRES(t, -1) != '.') {
+	if (t->npkts > t->first && !t->expanded && GETRES(t, -1) != '.') {
 		if (GETRES(t, -1) == ' ')
 			target_mark(t, t->npkts - 1, '?');
 		if (A_flag == 1)
 			bell();
-		else if (A_flag >= 2 &&
-		    GETRES(t, -4) == '.' &&
-		    GETRES(t, -3) == '.' &&
-		    GETRES(t, -2) != '.' &&
-		    GETRES(t, -1) != '.')
-			bell();
 	}
 
 	/* Check packet count limit */
@@ -114,10 +175,26 @@ target_probe(int fd, short what, void *thunk)
 		return;
 	}
 
+	/* Expanded hostnames only keep time, their addresses are probed */
+	if (t->expanded) {
+		t->res[t->npkts % NUM] = (t->next && t->next->parent == t) ?
+		    ' ' : '@';
+		binlog_result(t, t->npkts, -1);
+		t->npkts++;
+		board_update(t, t->npkts - 1, -1);
+		ui_update(t);
+		return;
+	}
+
 	/* Transmit request */
+	window_probe(t);
 	t->res[t->npkts % NUM] = ' ';
+	evutil_gettimeofday(&t->sent[t->npkts % RTT_SLOTS], NULL);
 	probe_send(t->prb, t->npkts);
 	t->npkts++;
+	rank_update(t);
+	subnet_update(t);
+	board_update(t, t->npkts - 1, -1);
 
 	ui_update(t);
 }
@@ -132,7 +209,7 @@ target_probe_sched(int fd, short what, void *thunk)
 
 	event_free(t->ev_write);
 	t->ev_write = event_new(ev_base, -1, EV_PERSIST, target_probe, t);
-	event_add(t->ev_write, &tv_interval);
+	event_add(t->ev_write, tv_interval_common);
 	target_probe(fd, what, thunk);
 }
 
@@ -142,34 +219,245 @@ target_probe_sched(int fd, short what, void *thunk)
 void
 target_mark(struct target *t, int seq, int ch)
 {
+	struct timeval now, tv;
+	long rtt = -1;
+	int old = t->res[seq % NUM];
+	int from = t->alert.state, to;
+
+	if (ch == '.' && t->res[seq % NUM] == ' ' &&
+	    seq >= t->npkts - RTT_SLOTS) {
+		/* smoothed as TCP does, 1/8 of each new sample */
+		evutil_gettimeofday(&now, NULL);
+		evutil_timersub(&now, &t->sent[seq % RTT_SLOTS], &tv);
+		rtt = tv.tv_sec * 1000000L + tv.tv_usec;
+		t->srtt = (t->srtt < 0) ? rtt : t->srtt + (rtt - t->srtt) / 8;
+		sketch_add(&t->rttsketch, rtt);
+		subnet_rtt(t, rtt);
+	}
 	if (ch == '.' && t->res[seq % NUM] != ' ')
 		t->res[seq % NUM] = ':';
 	else
 		t->res[seq % NUM] = ch;
-	if (a_flag && ch == '.') {
-		if (a_flag == 1)
-			bell();
-		else if (a_flag >=2 && t->npkts >= 4 &&
-		    t->res[(seq-3) % NUM] != '.' &&
-		    t->res[(seq-2) % NUM] != '.' &&
-		    t->res[(seq-1) % NUM] == '.' &&
-		    t->res[(seq-0) % NUM] == '.')
-			bell();
-	}
+	window_mark(t, seq, old);
+	if (a_flag == 1 && ch == '.')
+		bell();
+
+	rank_update(t);
+	subnet_update(t);
+	summary_result(t, seq, old, rtt);
+	to = alert_result(t, seq, old);
+	if (A_flag >= 2 && to == ALERT_DOWN && from != ALERT_DOWN &&
+	    from != ALERT_UNKNOWN)
+		bell();
+	else if (a_flag >= 2 && from == ALERT_DOWN && to != ALERT_DOWN)
+		bell();
+	if (J_flag)
+		report_result(t, seq, rtt);
+	metrics_result(t, seq, rtt);
+	binlog_result(t, seq, rtt);
+	board_update(t, seq, rtt);
+	ui_update(t);
+}
 
-	if (seq == t->npkts - 1)
-		ui_update(t);
+/*
+ * Set the address of a target.
+ */
+static void
+target_setaddr(struct target *t, int af, void *address)
+{
+
+	t->addr.sa.sa_family = af;
+	if (af == AF_INET6)
+		memcpy(&t->addr.sin6.sin6_addr, address,
+		    sizeof(t->addr.sin6.sin6_addr));
 	else
-		ui_update(NULL); /* this is a late reply, need full update to redraw this */
+		memcpy(&t->addr.sin.sin_addr, address,
+		    sizeof(t->addr.sin.sin_addr));
 }
 
 /*
- * Target resolved update address family
+ * Target resolved update address family, and the address it is indexed
+ * by when given
  */
 void
 target_resolved(struct target *t, int af, void *address)
 {
 	t->af = af;
+	if (af == 0 || address != NULL)
+		subnet_remove(t);
+	if (af != 0 && address != NULL) {
+		target_setaddr(t, af, address);
+		subnet_add(t);
+		if (J_flag)
+			report_resolved(t, probe_latency(t->prb));
+	}
+	board_update(t, -1, -1);
+	ui_update(NULL);
+}
+
+/*
+ * Label a target by the name of its address (-N).
+ */
+static void
+target_named(const char *name, void *thunk)
+{
+	struct target *t = thunk;
+
+	t->host[0] = '\0';
+	strncat(t->host, name, sizeof(t->host) - 1);
+	binlog_target(t);
+	board_update(t, -1, -1);
+	ui_update(NULL);
+}
+
+/*
+ * Look up the name of a target given by address, if asked to. Probing
+ * doesn't wait for it, the label changes once the name is known.
+ */
+static void
+target_name(struct target *t, int af, void *address)
+{
+
+	if (N_flag)
+		t->name = dnstask_new_name(af, address, target_named, t);
+}
+
+/*
+ * Remove a target, as done for addresses gone from an expanded hostname.
+ */
+static void
+target_remove(struct target *t)
+{
+
+	if (c_count && t->npkts >= c_count)
+		numcomplete--;
+	numtargets--;
+	rank_remove(t);
+	subnet_remove(t);
+	metrics_remove(t);
+	binlog_remove(t);
+	board_remove(t);
+	push_remove(t);
+	event_free(t->ev_write);
+	if (t->name)
+		dnstask_free(t->name);
+	probe_free(t->prb);
+	DL_DELETE(list, t);
+	free(t);
+	if (c_count && numcomplete >= numtargets)
+		event_base_loopexit(ev_base, NULL);
+}
+
+/*
+ * Add a target for an address of an expanded hostname, placed after
+ * the hostname's other addresses. It starts in step with the hostname.
+ */
+static struct target *
+target_add_sub(struct target *parent, struct target *after, int af,
+    void *address)
+{
+	struct target *t;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	memset(t->res, ' ', sizeof(t->res));
+	t->parent = parent;
+	t->npkts = parent->npkts;
+	t->first = t->npkts;
+	t->srtt = -1;
+	t->af = af;
+	target_setaddr(t, af, address);
+	evutil_inet_ntop(af, address, t->host, sizeof(t->host));
+	t->prb = probe_new_sub(parent->prb, af, address, t);
+	if (t->prb == NULL) {
+		free(t);
+		return NULL;
+	}
+	t->ev_write = event_new(ev_base, -1, EV_PERSIST, target_probe, t);
+	event_add(t->ev_write, tv_interval_common);
+	target_name(t, af, address);
+	rank_add(t);
+	subnet_add(t);
+	binlog_target(t);
+	board_add(t);
+	if (after->next == NULL)
+		DL_APPEND(list, t);
+	else
+		DL_PREPEND_ELEM(list, after->next, t);
+	numtargets++;
+	return t;
+}
+
+/*
+ * Find the address of an expanded hostname.
+ */
+static struct target *
+target_find_sub(struct target *parent, int af, void *address)
+{
+	struct target *t;
+
+	for (t = parent->next; t != NULL && t->parent == parent; t = t->next) {
+		if (t->addr.sa.sa_family != af)
+			continue;
+		if (af == AF_INET6 && memcmp(&t->addr.sin6.sin6_addr, address,
+		    sizeof(t->addr.sin6.sin6_addr)) == 0)
+			return t;
+		if (af == AF_INET && memcmp(&t->addr.sin.sin_addr, address,
+		    sizeof(t->addr.sin.sin_addr)) == 0)
+			return t;
+	}
+	return NULL;
+}
+
+/*
+ * Expand a hostname into a target per address (-E). Addresses are
+ * compared to the previous set, new ones are added and gone ones are
+ * removed, while those still present keep their history.
+ */
+void
+target_expand(struct target *parent, struct dnsset *set)
+{
+	struct target *t, *last, *keep[2 * DNSSET_MAX];
+	int nkeep = 0;
+	int i;
+
+	parent->expanded = 1;
+	last = parent;
+	for (i = 0; i < set->n6 + set->n4; i++) {
+		if (i < set->n6)
+			t = target_find_sub(parent, AF_INET6, &set->addr6[i]);
+		else
+			t = target_find_sub(parent, AF_INET,
+			    &set->addr4[i - set->n6]);
+		if (t != NULL)
+			keep[nkeep++] = t;
+	}
+	/* drop addresses not in the new set */
+	for (t = parent->next; t != NULL && t->parent == parent; t = last) {
+		last = t->next;
+		for (i = 0; i < nkeep && keep[i] != t; i++)
+			;
+		if (i == nkeep)
+			target_remove(t);
+	}
+	/* add new addresses after the kept ones */
+	for (last = parent; last->next && last->next->parent == parent; )
+		last = last->next;
+	for (i = 0; i < set->n6 + set->n4; i++) {
+		if (i < set->n6 &&
+		    target_find_sub(parent, AF_INET6, &set->addr6[i]) == NULL)
+			t = target_add_sub(parent, last, AF_INET6,
+			    &set->addr6[i]);
+		else if (i >= set->n6 && target_find_sub(parent, AF_INET,
+		    &set->addr4[i - set->n6]) == NULL)
+			t = target_add_sub(parent, last, AF_INET,
+			    &set->addr4[i - set->n6]);
+		else
+			continue;
+		if (t != NULL)
+			last = t;
+	}
 	ui_update(NULL);
 }
 
@@ -180,18 +468,31 @@ static int
 target_add(const char *line)
 {
 	struct target *t;
+	struct in6_addr addr6;
+	struct in_addr addr4;
 
 	t = (struct target *)calloc(1, sizeof(*t));
 	if (t == NULL)
 		return -1;
 	memset(t->res, ' ', sizeof(t->res));
 	strncat(t->host, line, sizeof(t->host) - 1);
+	t->srtt = -1;
 	DL_APPEND(list, t);
 	t->prb = probe_new(line, t);
 	if (t->prb == NULL) {
 		free(t);
 		return -1;
 	}
+	if (evutil_inet_pton(AF_INET6, line, &addr6) == 1) {
+		target_setaddr(t, AF_INET6, &addr6);
+		target_name(t, AF_INET6, &addr6);
+	} else if (evutil_inet_pton(AF_INET, line, &addr4) == 1) {
+		target_setaddr(t, AF_INET, &addr4);
+		target_name(t, AF_INET, &addr4);
+	}
+	rank_add(t);
+	subnet_add(t);
+	binlog_target(t);
 	numtargets++;
 	return 0;
 }
@@ -204,17 +505,31 @@ cleanup(void)
 {
 	struct target *t, *t_tmp;
 
+	if (D_file != NULL && dnstask_save(D_file) < 0)
+		perror(D_file);
 	DL_FOREACH_SAFE(list, t, t_tmp) {
 		event_free(t->ev_write);
+		if (t->name)
+			dnstask_free(t->name);
 		probe_free(t->prb);
 		free(t);
 	}
 	probe_cleanup();
+	rank_cleanup();
+	subnet_cleanup();
+	metrics_cleanup();
+	binlog_close();
+	board_close();
+	push_cleanup();
+	alert_cleanup();
+	if (ev_stats)
+		event_free(ev_stats);
 	evdns_base_free(dns, 0);
 	event_base_free(ev_base);
 #ifdef libevent_global_shutdown
 	libevent_global_shutdown();
 #endif /* !libevent_global_shutdown */
+	mempool_cleanup();
 	close(fd4);
 	close(fd6);
 }
@@ -226,8 +541,13 @@ usage(const char *whine)
 		fprintf(stderr, "%s\n", whine);
 	}
 	fprintf(stderr,
-	    "usage: xping [-46ABCTVah] [-c count] [-i interval] [-w width] "
-	    "host [host [...]]\n"
+	    "usage: xping [-46ABCEFJNRTVahs] [-c count] [-D cachefile] "
+	    "[-d thresholds]\n"
+	    "             [-e hook] [-G push] [-g interval] [-i interval]\n"
+	    "             [-j inflight] [-L logfile] [-M listen] "
+	    "[-P portrange]\n"
+	    "             [-p family] [-Q rate] [-S board] [-w width]\n"
+	    "             host [host [...]]\n"
 	    "\n");
 	exit(EX_USAGE);
 }
@@ -249,6 +569,8 @@ main(int argc, char *argv[])
 	int len;
 	char ch;
 
+	mempool_setup();
+
 #ifdef DO_SOCK_RAW
 	/* Open RAW-socket and drop root-privs */
 	fd4 = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
@@ -267,7 +589,7 @@ main(int argc, char *argv[])
 #endif /* DO_SOCK_RAW */
 
 	/* Parse command line options */
-	while ((ch = getopt(argc, argv, "46ABCTVahc:i:w:")) != -1) {
+	while ((ch = getopt(argc, argv, "46ABCEFJNRTVahsc:D:d:e:G:g:i:j:L:M:P:p:Q:S:w:")) != -1) {
 		switch(ch) {
 		case '4':
 			v4_flag = 1;
@@ -289,11 +611,84 @@ main(int argc, char *argv[])
 		case 'C':
 			C_flag = 1;
 			break;
+		case 'E':
+			E_flag = 1;
+			break;
+		case 'F':
+			F_flag = 1;
+			break;
+		case 'G':
+			G_push = optarg;
+			break;
+		case 'g':
+			g_interval = strtod(optarg, &end) * 1000;
+			if (*optarg == '\0' || *end != '\0' || g_interval < 1)
+				usage("Invalid push interval");
+			break;
+		case 'J':
+			J_flag = 1;
+			break;
+		case 'L':
+			L_file = optarg;
+			break;
+		case 'M':
+			M_listen = optarg;
+			break;
+		case 'N':
+			N_flag = 1;
+			break;
+		case 'R':
+			R_flag = 1;
+			break;
+		case 'P':
+			P_lo = strtol(optarg, &end, 10);
+			if (*end == '-')
+				P_hi = strtol(end + 1, &end, 10);
+			else
+				P_hi = P_lo;
+			if (*optarg == '\0' || *end != '\0')
+				usage("Invalid port range");
+			if (P_lo < 1 || P_hi > 65535 || P_lo > P_hi)
+				usage("Invalid port range");
+			break;
+		case 'p':
+			if (strcmp(optarg, "4") == 0)
+				p_family = AF_INET;
+			else if (strcmp(optarg, "6") == 0)
+				p_family = AF_INET6;
+			else
+				usage("Invalid family");
+			break;
 		case 'c':
 			c_count = strtol(optarg, &end, 10);
 			if (*optarg != '\0' && *end != '\0')
 				usage("Invalid count");
 			break;
+		case 'D':
+			D_file = optarg;
+			break;
+		case 'd':
+			d_alert = optarg;
+			break;
+		case 'e':
+			e_hook = optarg;
+			break;
+		case 'j':
+			j_inflight = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || j_inflight < 1)
+				usage("Invalid inflight limit");
+			break;
+		case 'Q':
+			Q_rate = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || Q_rate < 0)
+				usage("Invalid query rate");
+			break;
+		case 'S':
+			S_board = optarg;
+			break;
+		case 's':
+			s_flag = 1;
+			break;
 		case 'T':
 			T_flag = 1;
 			break;
@@ -324,14 +719,36 @@ main(int argc, char *argv[])
 	}
 	argc -= optind;
 	argv += optind;
+	if (!probe_tcp && (F_flag || R_flag || P_lo > 0))
+		usage("Options -F, -P and -R are for xping-http only");
+	if (alert_init(d_alert, e_hook) < 0)
+		usage("Invalid alert thresholds");
 
 	tv_interval.tv_sec = i_interval / 1000;
 	tv_interval.tv_usec = i_interval % 1000 * 1000;
 
 	/* Prepare event system and inbound socket */
 	ev_base = event_base_new();
+	tv_interval_common = event_base_init_common_timeout(ev_base,
+	    &tv_interval);
+	if (tv_interval_common == NULL)
+		tv_interval_common = &tv_interval;
 	dns = evdns_base_new(ev_base, 1);
+	if (D_file != NULL && dnstask_load(D_file) < 0)
+		fprintf(stderr, "%s: ignoring invalid DNS cache\n", D_file);
 	probe_setup();
+	if (M_listen != NULL && metrics_init(M_listen) < 0) {
+		perror(M_listen);
+		return 1;
+	}
+	if (G_push != NULL && push_init(G_push, g_interval) < 0) {
+		perror(G_push);
+		return 1;
+	}
+	if (L_file != NULL && binlog_open(L_file) < 0) {
+		perror(L_file);
+		return 1;
+	}
 
 	/* Read targets from program arguments and/or stdin. */
 	list = NULL;
@@ -357,7 +774,7 @@ main(int argc, char *argv[])
 			}
 		}
 	}
-	if (!isatty(STDOUT_FILENO)) {
+	if (!isatty(STDOUT_FILENO) || J_flag) {
 		ui_init = report_init;
 		ui_update = report_update;
 		ui_cleanup = report_cleanup;
@@ -367,6 +784,16 @@ main(int argc, char *argv[])
 		usage("no arguments");
 		/* NEVER REACHED */
 	}
+	if (S_board != NULL) {
+		/* room for the addresses of expanded hostnames */
+		if (board_open(S_board, numtargets *
+		    (E_flag ? 1 + 2 * DNSSET_MAX : 1)) < 0) {
+			perror(S_board);
+			return 1;
+		}
+		DL_FOREACH(list, t)
+			board_add(t);
+	}
 
 	/* Initial scheduling with increasing delay, distributes
 	 * transmissions across the interval and gives a cascading effect. */
@@ -383,9 +810,13 @@ main(int argc, char *argv[])
 	/* Startup UI and probing */
 	signal(SIGINT, sigint);
 	signal(SIGTERM, sigint);
+	ev_stats = evsignal_new(ev_base, SIGUSR1, stats_dump, NULL);
+	event_add(ev_stats, NULL);
 	ui_init();
 	event_base_dispatch(ev_base);
 	ui_cleanup();
+	if (s_flag)
+		summary_print(stdout, J_flag);
 	cleanup();
 	return 0;
 }
@@ -5,6 +5,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include <stdint.h>
+#include <stdio.h>
+
 #include <event2/event.h>
 
 #include "uthash.h"
@@ -12,6 +15,12 @@
 
 #define NUM 300
 #define MAXHOST 64
+#define RTT_SLOTS 4	/* probes in flight timed for round trip time */
+#define LOSS_WINDOW 20	/* probes counted for recent loss, ranking */
+#define LOSS_WINDOWS 4	/* recent loss counted over, see window.c */
+#define WINDOW_RANK 1	/* of those, the one of LOSS_WINDOW */
+#define RTT_BUCKETS 12	/* round trip time histogram, metrics exporter */
+#define SKETCH_BINS 128	/* round trip time sketch, see sketch.c */
 
 extern struct event_base *ev_base;
 extern struct target *list;
@@ -22,6 +31,59 @@ extern int numtargets;
 extern int fd4, fd4errno;
 extern int fd6, fd6errno;
 
+/*
+ * Results of targets added up, by the target itself and for every
+ * prefix it is within (subnet roll-up view).
+ */
+struct rollup {
+	int		targets;
+	int		down;	/* all recent probes lost */
+	int		probes;	/* recent probes */
+	int		lost;
+	int		rtts;	/* targets with a round trip time */
+	long		rttsum;	/* microseconds */
+};
+
+/*
+ * Sketch of round trip times, for their quantiles.
+ */
+struct sketch {
+	unsigned long	count;
+	int		lo;		/* bin 0 */
+	int		top;		/* highest bin added */
+	unsigned int	bins[SKETCH_BINS];
+};
+
+/*
+ * Summary of the results of a target (-s).
+ */
+struct summary {
+	unsigned long	probes;
+	unsigned long	lost;
+	unsigned long	transitions;	/* between replies and losses */
+	int		down;		/* last probe lost */
+	int		run;		/* probes lost in a row, so far */
+	int		longest;	/* run */
+	unsigned long	rtts;
+	long		rttmin;		/* microseconds */
+	long		rttmax;
+	unsigned long	rttsum;
+};
+
+/*
+ * State of a target, alerting (-d, -e).
+ */
+#define ALERT_UNKNOWN	0
+#define ALERT_UP	1
+#define ALERT_DEGRADED	2
+#define ALERT_DOWN	3
+struct alert {
+	int		state;
+	int		okrun;		/* replies in a row */
+	int		lostrun;	/* probes lost in a row */
+	unsigned int	loss;		/* recent, 1/65536 */
+};
+
 union addr {
 	struct sockaddr sa;
 	struct sockaddr_in sin;
@@ -39,6 +101,60 @@ struct target {
 	int		row;
 	int		af;
 
+	/* hostnames expanded by address (-E) */
+	int		expanded;
+	struct target	*parent;
+	int		first;
+	union addr	addr;
+
+	/* reverse lookup of address targets (-N) */
+	struct dnstask	*name;
+
+	/* round trip time and ranking, worst offenders view */
+	struct timeval	sent[RTT_SLOTS];
+	long		srtt;	/* smoothed, microseconds or -1 */
+	int		loss;
+	int		rankidx;
+
+	/* probes lost in recent windows, see window.c */
+	int		window[LOSS_WINDOWS];
+
+	/* round trip times for their quantiles, see sketch.c */
+	struct sketch	rttsketch;
+
+	/* subnet roll-up view, prefix holding the address */
+	struct subnet	*subnet;
+	struct rollup	rollup;
+
+	/* counters, metrics exporter (-M) and status board (-S) */
+	unsigned long	received;
+	unsigned long	late;
+	unsigned long	unreachable;
+	unsigned long	errors;
+	unsigned long	rtthist[RTT_BUCKETS + 1];
+	unsigned long	rttsum;	/* microseconds */
+
+	/* summary (-s) */
+	struct summary	summary;
+
+	/* state, alerting (-d, -e) and bells (-A, -a) */
+	struct alert	alert;
+
+	/* counters as of the last push (-G) */
+	struct {
+		int		settled;	/* probes counted for loss */
+		unsigned long	sent;
+		unsigned long	received;
+		unsigned long	rtts;
+		unsigned long	rttsum;
+	}		pushed;
+
+	/* number in the binary log (-L), 0 when not logged */
+	unsigned int	logidx;
+
+	/* record in the status board (-S) + 1, 0 when not published */
+	int		boardidx;
+
 	struct target	*prev, *next;
 };
 
@@ -49,6 +165,11 @@ struct target {
 void target_mark(struct target *, int, int);
 void target_unmark(struct target *, int);
 void target_resolved(struct target *, int, void *);
+struct dnsset;
+void target_expand(struct target *, struct dnsset *);
+
+typedef void (*stats_cb_type)(const char *, unsigned long, void *);
+void stats_walk(stats_cb_type, void *);
 
 /* from "version.c" */
 extern const char version[];
@@ -58,21 +179,155 @@ void termio_init(void);
 void termio_update(struct target *);
 void termio_cleanup(void);
 
+/* from rank.c */
+#define RANK_LOSS	1
+#define RANK_RTT	2
+int rank_add(struct target *);
+void rank_remove(struct target *);
+void rank_update(struct target *);
+void rank_mode(int);
+int rank_top(struct target **, int);
+void rank_cleanup(void);
+
+/* from subnet.c */
+int subnet_add(struct target *);
+void subnet_remove(struct target *);
+void subnet_update(struct target *);
+void subnet_rtt(struct target *, long);
+int subnet_count(int);
+int subnet_visible(struct subnet **, int, int, int);
+void subnet_print(struct subnet *, char *, size_t, int);
+int subnet_down(struct subnet *);
+void subnet_cleanup(void);
+
+/* from sketch.c */
+void sketch_add(struct sketch *, long);
+void sketch_merge(struct sketch *, const struct sketch *);
+void sketch_subtract(struct sketch *, const struct sketch *);
+double sketch_quantile(const struct sketch *, double);
+
+/* from window.c */
+extern const int window_size[LOSS_WINDOWS];
+void window_probe(struct target *);
+void window_mark(struct target *, int, int);
+void window_reset(struct target *);
+int window_probes(struct target *, int);
+
+/* from metrics.c */
+int metrics_init(const char *);
+void metrics_result(struct target *, int, long);
+void metrics_remove(struct target *);
+void metrics_stats(stats_cb_type, void *);
+void metrics_cleanup(void);
+
+/* from binlog.c */
+#define BINLOG_MAGIC		"XPINGLOG"
+#define BINLOG_VERSION		1
+#define BINLOG_HDR		32	/* file header */
+#define BINLOG_BLOCK		4096
+#define BINLOG_BLOCK_MAGIC	"XPLB"
+#define BINLOG_BLOCK_HDR	16
+#define BINLOG_F_CHECKPOINT	0x01	/* block names all targets first */
+#define BINLOG_CHECKPOINT	64	/* blocks apart per checkpoint block */
+#define BINLOG_RESULT		0
+#define BINLOG_TARGET		1
+#define BINLOG_REMOVE		2
+struct binlog_reader {
+	const unsigned char	*map;
+	size_t			nblocks;
+	size_t			block;	/* being read */
+	size_t			off;	/* in it, 0 when not started */
+	uint64_t		time;	/* of last record */
+};
+struct binlog_record {
+	int		type;
+	uint64_t	time;	/* microseconds */
+	unsigned int	idx;
+	int		seq;
+	int		symbol;
+	long		rtt;	/* microseconds or -1 */
+	const char	*name;
+	size_t		namelen;
+};
+int binlog_open(const char *);
+void binlog_target(struct target *);
+void binlog_remove(struct target *);
+void binlog_result(struct target *, int, long);
+void binlog_stats(stats_cb_type, void *);
+void binlog_close(void);
+int binlog_reader(struct binlog_reader *, const void *, size_t);
+void binlog_seek(struct binlog_reader *, uint64_t);
+int binlog_read(struct binlog_reader *, struct binlog_record *);
+
+/* from board.c */
+int board_open(const char *, int);
+void board_add(struct target *);
+void board_remove(struct target *);
+void board_update(struct target *, int, long);
+void board_stats(stats_cb_type, void *);
+void board_close(void);
+
+/* from push.c */
+int push_init(const char *, int);
+void push_remove(struct target *);
+void push_stats(stats_cb_type, void *);
+void push_cleanup(void);
+
+/* from summary.c */
+void summary_result(struct target *, int, int, long);
+void summary_print(FILE *, int);
+
+/* from alert.c */
+int alert_init(const char *, const char *);
+int alert_result(struct target *, int, int);
+void alert_stats(stats_cb_type, void *);
+void alert_cleanup(void);
+
+/* from mempool.c */
+void mempool_setup(void);
+void mempool_cleanup(void);
+void mempool_stats(stats_cb_type, void *);
+
 /* from report.c */
 void report_init(void);
 void report_update(struct target *);
+void report_result(struct target *, int, long);
+void report_resolved(struct target *, long);
+void report_event(struct target *, int, const char *, const char *);
+void report_clock(const struct timeval *);
+void report_stats(stats_cb_type, void *);
 void report_cleanup(void);
 
 /* from icmp.c */
+extern const int probe_tcp;	/* probes connect, -F, -R and -P apply */
 void probe_setup();
 void probe_cleanup();
 struct probe *probe_new(const char *, void *);
 void probe_free(struct probe *);
 void probe_send(struct probe *, int);
+void probe_stats(stats_cb_type, void *);
+long probe_latency(struct probe *);
+struct probe *probe_new_sub(struct probe *, int, void *, void *);
 
 /* from dnstask.c */
+#define DNSTASK_DUAL	0x01	/* report IPv6 and IPv4 address, each */
+#define DNSSET_MAX	8	/* addresses kept per family */
+struct dnsset {
+	int		n6;
+	int		n4;
+	struct in6_addr	addr6[DNSSET_MAX];
+	struct in_addr	addr4[DNSSET_MAX];
+};
 typedef void (*dnstask_cb_type)(int, void *, void *);
-struct dnstask *dnstask_new(const char *, dnstask_cb_type, void *);
+typedef void (*dnstask_set_cb_type)(struct dnsset *, void *);
+typedef void (*dnstask_name_cb_type)(const char *, void *);
+struct dnstask *dnstask_new(const char *, int, dnstask_cb_type, void *);
+struct dnstask *dnstask_new_set(const char *, dnstask_set_cb_type, void *);
+struct dnstask *dnstask_new_name(int, void *, dnstask_name_cb_type, void *);
 void dnstask_free(struct dnstask *);
+int dnstask_load(const char *);
+int dnstask_save(const char *);
+long dnstask_latency(struct dnstask *);
+void dnstask_stats(stats_cb_type, void *);
 
 #endif /* !XPING_H */
@@ -0,0 +1,103 @@
+/*-
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <mph@hoth.dk> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Martin Topholm
+ * ----------------------------------------------------------------------------
+ */
+
+#ifndef XPINGBOARD_H
+#define XPINGBOARD_H
+
+/*
+ * Status board of xping (-S), a file mapped shared by xping and any
+ * number of readers, e.g. one in /dev/shm. A header is followed by a
+ * record per target. xping only writes a record, readers only read, so
+ * they never hold xping up and need no system call to poll it.
+ *
+ * Each record is guarded by a sequence lock: the sequence is odd while
+ * the record is being written and advanced again when done. A reader
+ * copies the record and keeps the copy only if the sequence was even
+ * and unchanged across it, see xpb_read(). Records have no order;
+ * records not in use have flags 0 and are reused as targets come and
+ * go. Readers check the version, and find records and results by the
+ * sizes given in the header, so fields may be added at the end in a
+ * later version without breaking them.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define XPB_MAGIC	"XPBOARD"
+#define XPB_VERSION	1
+#define XPB_WINDOW	256	/* recent results per target */
+#define XPB_USED	0x01	/* record of a target */
+
+struct xpb_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	hdrsize;	/* records start here */
+	uint32_t	recsize;
+	uint32_t	window;		/* results per record */
+	uint32_t	capacity;	/* records */
+	uint32_t	used;		/* records used so far */
+	int32_t		pid;		/* of xping, 0 once exited */
+	int32_t		interval;	/* of probes, milliseconds */
+	uint64_t	started;	/* microseconds, epoch */
+};
+
+struct xpb_target {
+	uint32_t	seq;		/* odd while written */
+	uint32_t	flags;
+	char		host[64];
+	int32_t		af;		/* 0 while unresolved */
+	int32_t		npkts;		/* probes sent */
+	int32_t		first;		/* first probe */
+	int32_t		reserved;
+	/* round trip times, microseconds */
+	int64_t		rtt;		/* last, or -1 */
+	int64_t		srtt;		/* smoothed, or -1 */
+	uint64_t	received;	/* replies in time */
+	uint64_t	late;
+	uint64_t	unreachable;
+	uint64_t	errors;
+	/* result of probe n at n % window, as drawn by xping */
+	char		res[XPB_WINDOW];
+};
+
+/*
+ * Record i of a mapped board.
+ */
+static inline const struct xpb_target *
+xpb_record(const struct xpb_header *h, uint32_t i)
+{
+
+	return (const struct xpb_target *)((const char *)h + h->hdrsize +
+	    (size_t)i * h->recsize);
+}
+
+/*
+ * Copy a record consistently. Returns 0 with the copy, or -1 if it was
+ * being written at every try.
+ */
+static inline int
+xpb_read(const struct xpb_target *rec, struct xpb_target *copy)
+{
+	uint32_t s1, s2;
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		s1 = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (s1 & 1)
+			continue;
+		memcpy(copy, rec, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+		if (s1 == s2)
+			return 0;
+	}
+	return -1;
+}
+
+#endif /* !XPINGBOARD_H */